@@ -24,11 +24,14 @@
 
 //#include "mirtk/Geometry.h"
 #include "mirtk/BiasField.h"
+#include "mirtk/Array.h"
 
 #define BIASLOOKUPTABLESIZE 1000
 
 namespace mirtk {
 
+struct BSplineFitPoints;
+
 class BSplineBiasField : public BiasField
 {
 	mirtkObjectMacro(BSplineBiasField);
@@ -101,6 +104,21 @@ protected:
 	 * function values */
 	static    double LookupTable_II[BIASLOOKUPTABLESIZE][4];
 
+	/// Banded normal equations of the least square fit, for each control point the
+	/// coefficients of the 7x7x7 control points around it; kept between fits
+	Array<double> _normal_matrix;
+
+	/// Points of the least square fit sorted by the plane of their lattice cell
+	Array<int> _point_order;
+	Array<int> _plane_start;
+
+	/// Returns the plane of the lattice cell of lattice coordinate z
+	int CellPlane(double z) const;
+
+	/// Sums the banded normal equations of the points in parallel and solves them
+	/// by conjugate gradients
+	void FitNormalEquations(const BSplineFitPoints &points, int no);
+
 public:
 
 	/// Returns the value of the i-th B-spline basis function with segment dependent parameter
@@ -109,6 +127,10 @@ public:
 	/// Returns the value of the i-th B-spline basis function with global parameter
 	static double N(int i, double u, int L);
 
+	/// Returns the first of the four basis functions which are non-zero at the global parameter u
+	/// and their values, from the lookup table where the basis is the uniform B-spline
+	static void BasisValues(double u, int L, int &first, double *values);
+
 	/// Returns the 1st derivative value of the i-th B-spline basis function
 	static double B_I(int, double);
 
@@ -142,6 +164,9 @@ public:
 	/// Calculate weighted least square fit of B-spline to data
 	virtual void WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no);
 
+	/// Calculate weighted least square fit of B-spline to the voxels
+	virtual void WeightedLeastSquares(const BiasFieldSamples &samples);
+
 	/** Interpolates displacements: This function takes a set of displacements
       defined at the control points and finds a FFD which interpolates these
       displacements.
@@ -176,6 +201,15 @@ public:
 	virtual int Ind(int, int, int);
 };
 
+inline int BSplineBiasField::CellPlane(double z) const
+{
+	if (_z < 2) return 0;
+	if (z < 0) z = 0;
+	if (z > _z-1) z = _z-1;
+	const int n = (int)floor(z);
+	return (n == _z-1) ? _z-2 : n;
+}
+
 inline int BSplineBiasField::Ind(int a, int b, int c)
 {
 	if(a<0) return -1;
@@ -24,6 +24,8 @@
 
 #include "mirtk/Image.h"
 
+#include "mirtk/Array.h"
+
 #include "mirtk/Resampling.h"
 
 #include "mirtk/Transformation.h"
@@ -32,6 +34,17 @@
 
 namespace mirtk {
 
+/// Visits the rows of the image once Apply has corrected them, e.g. to sum statistics of the
+/// corrected voxels in the same pass. The rows of a slice are visited in order by one thread.
+class BiasCorrectionRows
+{
+public:
+	virtual ~BiasCorrectionRows() {}
+
+	/// Row j of slice k is corrected
+	virtual void Row(int j, int k) = 0;
+};
+
 class BiasCorrection : public Object
 {
 	mirtkObjectMacro(BiasCorrection);
@@ -45,6 +58,9 @@ protected:
 	RealImage *_weights;
 	ByteImage *_mask;
 
+	/// Image indices of the voxels inside the mask (NULL to scan the mask)
+	const Array<int> *_voxels;
+
 	/// Output
 	BiasField *_biasfield;
 
@@ -76,12 +92,18 @@ public:
 
 	virtual void SetMask( ByteImage *);
 
+	/// Sets the list of voxels inside the mask, e.g. the active voxels of the EM
+	virtual void SetVoxels(const Array<int> *);
+
 	/// Runs the bias correction filter
 	virtual void Run();
 
 	/// Apply bias correction to _input
 	virtual void Apply(RealImage &);
 
+	/// Apply bias correction to _input and visit each corrected row
+	virtual void Apply(RealImage &, BiasCorrectionRows *);
+
 	/// Apply bias correction to any image
 	virtual void ApplyToImage(RealImage &);
 
@@ -110,6 +132,11 @@ inline void BiasCorrection::SetOutput(BiasField *biasfield)
 	_biasfield = biasfield;
 }
 
+inline void BiasCorrection::SetVoxels(const Array<int> *voxels)
+{
+	_voxels = voxels;
+}
+
 inline void BiasCorrection::SetPadding(short Padding)
 {
 	_Padding = Padding;
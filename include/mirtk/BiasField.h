@@ -34,6 +34,60 @@
 
 namespace mirtk {
 
+/**
+ * Voxels of a weighted least square fit of the bias field to target - reference.
+ * The world coordinates of a voxel are computed from its index when needed,
+ * hence a fit needs no arrays of coordinates.
+ */
+struct BiasFieldSamples
+{
+	const RealPixel *_target;
+	const RealPixel *_reference;
+	const RealPixel *_weights;
+
+	/// Voxels of the mask with value 1 are fitted if _voxels is NULL
+	const BytePixel *_mask;
+
+	/// Image indices of the voxels (NULL for all voxels of the image)
+	const int *_voxels;
+
+	/// Number of indices in _voxels or of voxels of the image
+	int _number_of_voxels;
+
+	/// Image size in x and y
+	int _x, _y;
+
+	/// Voxels with this target value are not fitted
+	double _padding;
+
+	/// Image to world coordinates, world = _matI2W * (i, j, k, 1)
+	double _matI2W[3][4];
+
+	/// Returns the image index of voxel s, -1 if the voxel is not fitted
+	int Index(int s) const;
+
+	/// Returns the world coordinates of the voxel with image index
+	void World(int index, double &x, double &y, double &z) const;
+};
+
+inline int BiasFieldSamples::Index(int s) const
+{
+	const int index = _voxels ? _voxels[s] : s;
+	if (_target[index] == _padding) return -1;
+	if (_voxels == NULL && _mask[index] != 1) return -1;
+	return index;
+}
+
+inline void BiasFieldSamples::World(int index, double &x, double &y, double &z) const
+{
+	const double i = index % _x;
+	const double j = (index / _x) % _y;
+	const double k = index / (_x * _y);
+	x = _matI2W[0][0] * i + _matI2W[0][1] * j + _matI2W[0][2] * k + _matI2W[0][3];
+	y = _matI2W[1][0] * i + _matI2W[1][1] * j + _matI2W[1][2] * k + _matI2W[1][3];
+	z = _matI2W[2][0] * i + _matI2W[2][1] * j + _matI2W[2][2] * k + _matI2W[2][3];
+}
+
 class BiasField : public Object
 {
 	mirtkAbstractMacro(BiasField);
@@ -99,6 +153,10 @@ public:
 	/// Calculate weighted least square fit to data
 	virtual void WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no)=0;
 
+	/// Calculate weighted least square fit to the voxels, by default with arrays of the
+	/// coordinates, bias and weights of the fitted voxels
+	virtual void WeightedLeastSquares(const BiasFieldSamples &samples);
+
 
 	/** Interpolates displacements: This function takes a set of displacements
       defined at the control points and finds a FFD which interpolates these
@@ -203,6 +261,9 @@ public:
 	/// Calculate value of bias field at a point
 	virtual double Bias(double, double, double) = 0;
 
+	/// Calculate the bias at the n points p + i*d (i = 0..n-1), e.g. a row of voxels
+	virtual void BiasRow(const double *p, const double *d, int n, double *bias);
+
 	/// Reads a transformation from a file (abstract)
 	virtual void Read (char *) = 0;
 
@@ -44,6 +44,15 @@ class DrawEM : public EMBase
 {
     mirtkObjectMacro(DrawEM);
 
+public:
+    /// update order of the posteriors in the MRF E-step
+    enum MRFUpdate
+    {
+        MRFSequential, ///< in place in scan order
+        MRFJacobi,     ///< from the posteriors of the previous iteration, in parallel
+        MRFRedBlack    ///< in place by colour (checkerboard), each colour in parallel
+    };
+
 protected:
     //
 
@@ -84,9 +93,77 @@ protected:
     Array<int> tissuelabels;
     int csflabel,wmlabel,gmlabel,outlabel;
 
+    /// linear offsets, weights and (x,y,z) shifts of the MRF neighbours (6 or 26)
+    Array<int> _mrf_offsets;
+    Array<double> _mrf_weights;
+    Array<int> _mrf_shifts;
+    /// linear offsets, weights and (x,y,z) shifts of the 26 neighbours, see getMRFenergy_diag
+    Array<int> _mrf_diag_offsets;
+    Array<double> _mrf_diag_weights;
+    Array<int> _mrf_diag_shifts;
+
+    /// non-zero connectivity(k,t) of each tissue t, compiled from _connectivity
+    Array<int> _conn_offsets;
+    Array<int> _conn_labels;
+    Array<double> _conn_values;
+    /// structures j with connectivity(k,j) > 1 of each structure k
+    Array<int> _conn_far_offsets;
+    Array<int> _conn_far_labels;
+
+    /// update order of the MRF E-step
+    MRFUpdate _mrf_update;
+    /// posteriors the MRF neighbours are read from (NULL for _output)
+    HashProbabilisticAtlas *_mrf_source;
+    /// second buffer of the Jacobi MRF E-step, holds the previous posteriors while the
+    /// new ones are written to _output (swapped each E-step)
+    HashProbabilisticAtlas _mrf_previous;
+
+    /// active set E-step: posterior change below which a voxel is converged (0 updates all voxels)
+    double _mrf_tolerance;
+    /// every n-th MRF E-step updates all voxels (0 for none after the first)
+    int _mrf_full_sweep;
+    /// number of MRF E-steps so far
+    int _mrf_sweep;
+    /// per active voxel, posterior changed by more than the tolerance in the last MRF E-step
+    Array<unsigned char> _mrf_changed;
+    /// per active voxel, updated in the current MRF E-step
+    Array<unsigned char> _mrf_selected;
+
 private:
     bool isPVclass(int pvclass);
-    double getMRFenergy(int index, int tissue);
+    /// compiles the connectivity matrix into lists of the non-zero entries
+    void compileConnectivity();
+    /// precomputes the MRF neighbour offsets
+    void initMRFKernel();
+    /// adds the weighted posteriors of a neighbour to the sums of the structures
+    void addMRFNeighbour(int index, double weight, double *sums);
+    /// computes the MRF energies of all tissues at the voxel with one neighbour sum per structure,
+    /// the 6 neighbours of an active voxel (id >= 0) are taken from the active neighbour list
+    void getMRFenergies(int index, int id, double *sums, double *energies);
+    /// computes the posteriors of all structures at the active voxel, work holds 4*K values
+    void EStepMRFVoxel(int id, const Gaussian *G, double *work, ProbabilityPixel *posterior);
+    /// colour of the voxel for the parallel MRF update
+    int getMRFColour(int index, int colours) const;
+    /// selects the changed voxels and their neighbours for the MRF E-step, returns their number
+    int selectMRFVoxels();
+    /// records whether the new posteriors of the active voxel differ from the current by more than the tolerance
+    void setMRFChanged(int id, const ProbabilityPixel *posterior);
+    /// prints the number of voxels changed in the last MRF E-step
+    void printMRFChanged() const;
+    /// fits the bias field to the weights and estimate of the W-step
+    void fitBiasField();
+    /// bias corrects the input and returns the log likelihood of the corrected input in the same pass
+    double bStepLogLikelihood();
+    /// bias corrects the input and sums the M-step statistics of the corrected input in the same pass
+    void bStepMStepSums();
+    /// applies the bias field to the input, with the M-step sums and (if G is given) the
+    /// log likelihood of the corrected active voxels added in the same pass, returns the log likelihood
+    double applyBiasFieldSums(bool mstep, const Gaussian *G);
+
+    struct EStepMRFBody;
+    struct WriteMRFBody;
+    struct CopyMRFBody;
+    struct CorrectedRows;
     double getMRFInterEnergy(int index, int tissue);
 
 public:
@@ -118,6 +195,17 @@ public:
     /// Estimates bias field
     virtual void BStep();
 
+    /// Corrects the input with the current bias field without fitting it, e.g. one of a coarser level
+    void ApplyBiasField();
+
+    /// Writes the Gaussian parameters, priors, posteriors, bias field and PV classes
+    /// together with the state of the caller (e.g. iteration and phase) to a checkpoint file
+    void WriteCheckpoint(const char *filename, const Array<int> &state);
+    /// Reads the state of the caller from a checkpoint file
+    static void ReadCheckpointState(const char *filename, Array<int> &state);
+    /// Restores a checkpoint after Initialise, the bias field must have the degree of the checkpoint
+    void ReadCheckpoint(const char *filename);
+
 protected:
 
     using EMBase::SetInput;
@@ -133,6 +221,13 @@ public:
     /// Execute one iteration and return log likelihood
     virtual double Iterate(int iteration);
 
+    /// Executes one iteration in the order of draw-em: E-step (with MRF if mrf), Hui PV correction
+    /// if hui, W- and B-step if bias, M-step, and returns the relative change of the log likelihood.
+    /// The parameters are extrapolated only if extrapolate, see Accelerate.
+    /// With fused passes the W-step is computed in the E-step pass and the M-step sums in the
+    /// pass that applies the bias field (in the E-step pass without bias correction).
+    double IterateSegmentation(bool mrf, bool hui, bool bias, bool extrapolate);
+
     /// Compute the bias corrected image
     virtual void GetBiasCorrectedImage(RealImage &);
 
@@ -141,7 +236,12 @@ public:
     virtual void setMRFstrength(double mrfw);
     /// set a 26-neighborhood in the MRF
     virtual void setbignn(bool bnn);
-    /// computes the MRF with the 26-neighborhood
+    /// set the update order of the MRF E-step
+    virtual void setMRFUpdate(MRFUpdate update);
+    /// only update the voxels whose posteriors or neighbours changed by more than tolerance,
+    /// with all voxels updated every fullsweep-th MRF E-step
+    virtual void setMRFActiveSet(double tolerance, int fullsweep);
+    /// computes the MRF with the 26-neighborhood for a single voxel and tissue, see initMRFKernel
     double getMRFenergy_diag(int index, int tissue);
 
     /// removes the PV classes!
@@ -174,6 +274,8 @@ public:
 
 inline void DrawEM::setHui(bool hui){huipvcorr=hui;}
 inline void DrawEM::setbignn(bool bnn){bignn=bnn;}
+inline void DrawEM::setMRFUpdate(MRFUpdate update){_mrf_update=update;}
+inline void DrawEM::setMRFActiveSet(double tolerance, int fullsweep){_mrf_tolerance=tolerance; _mrf_full_sweep=fullsweep; _mrf_changed.clear();}
 inline void DrawEM::setMRFstrength(double mrfw){mrfweight=mrfw;}
 inline void DrawEM::setMRFInterAtlas(RealImage **&atlas){	_MRF_inter=atlas; intermrf=true;}
 inline void DrawEM::setBeta(double b){beta=b;}
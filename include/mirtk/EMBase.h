@@ -28,6 +28,7 @@
 #include "mirtk/Gaussian.h"
 #include "mirtk/Histogram1D.h"
 #include "mirtk/MeanShift.h"
+#include "mirtk/Parallel.h"
 
 /*
 
@@ -99,10 +100,133 @@ protected:
   /// whether a mask is set
   bool _mask_set;
 
+  /// image index of each voxel inside the mask (active voxel id -> index), built by CreateMask
+  Array<int> _active;
+
+  /// active ids of the 6 face neighbours of each active voxel in the order -z,-y,-x,+x,+y,+z,
+  /// the voxel itself outside of the image and -1 outside of the mask
+  Array<int> _active_neighbours;
+
   /// whether initial posteriors is set
   bool _posteriors_set;
 
+  /// whether atlas and posteriors are stored densely inside the mask
+  bool _dense_storage;
+
+  /// whether atlas and posteriors only keep the structures above _sparse_epsilon per voxel
+  bool _sparse_storage;
+
+  /// probabilities up to this value are dropped with sparse storage
+  double _sparse_epsilon;
+
+  /// directory of the memory-mapped scratch files of atlas and posteriors (empty to keep them in memory)
+  string _scratch_directory;
+
+  /// whether likelihoods are kept for passes with the same parameters and input
+  bool _cache_likelihoods;
+
+  /// whether the likelihoods are looked up in a table of the distinct intensities of the active voxels
+  bool _likelihood_table;
+
+  /// likelihoods of all structures for each row, a row per masked voxel or per distinct intensity
+  Array<double> _likelihoods;
+
+  /// intensity of each row
+  Array<double> _likelihood_values;
+
+  /// row of the likelihoods of each active voxel
+  Array<int> _likelihood_rows;
+
+  /// parameters of the cached likelihoods
+  Array<double> _likelihood_mi;
+  Array<double> _likelihood_sigma;
+
+  /// whether the cached likelihoods belong to the current input and mask
+  bool _likelihoods_valid;
+
+  /// Recomputes the cached or tabulated likelihoods if the parameters or the input changed,
+  /// returns the likelihoods (NULL if the likelihoods are evaluated exactly for each voxel)
+  const double *UpdateLikelihoods();
+
+  /// Marks the cached likelihoods as out of date
+  void InvalidateLikelihoods();
+
+  /// Returns the cached likelihoods of all structures at an active voxel (NULL if not cached)
+  const double *GetCachedLikelihoods(int id) const;
+
+  /// Builds the list of active voxels inside the mask and their neighbours
+  void CreateActiveVoxels();
+
+  /// whether the E-step also sums the statistics of the M-step, see SetFusedIteration
+  bool _fused_iteration;
+
+  /// M-step sums of the last E-step (see GetMStepSums), the sums of each block and the means they are centred at
+  Array<double> _mstep_sums;
+  Array<double> _mstep_blocks;
+  Array<double> _mstep_shift;
+
+  /// whether _mstep_sums belong to the current posteriors and input
+  bool _mstep_sums_valid;
+
+  /// whether a fused E-step computes the W-step per block instead of the M-step sums (the M-step
+  /// then follows the B-step), and whether the last E-step did so
+  bool _fused_wstep;
+  bool _fused_wstep_done;
+
+  /// Prepares the block sums of a fused E-step, returns false if the passes are not fused
+  bool BeginMStepSums();
+
+  /// Adds the posteriors of the active voxels of block b to the M-step block sums (or computes
+  /// their weights and estimates, see _fused_wstep), hashed posteriors are read from the buffer
+  /// of the active voxels from offset if given
+  void AddMStepBlockSums(int b, const ProbabilityPixel *posteriors = NULL, int offset = 0);
+
+  /// Adds up the block sums of a fused E-step
+  void EndMStepSums();
+
+  /// Returns the range of the active voxels in row j of slice k
+  void GetRowActiveVoxels(int j, int k, int &begin, int &end) const;
+
+  /// Returns the sums of p, p*(x-s_k), p*(x-s_k)^2 and the number of voxels with p != 0 of each
+  /// structure k, centred at the current means s, from the last E-step if still valid
+  void GetMStepSums(Array<double> &shift, Array<double> &sums);
+
+  /// Runs an E-step body on all active voxels
+  template <class Body>
+  void RunEStep(Body &body);
+
+  /// Runs an E-step body on whole blocks of active voxels and adds the M-step sums of each block
+  template <class Body>
+  struct FusedEStepBody;
+
+  /// Returns the log likelihood of the active voxels of block b (of MStepBlockSize voxels) with
+  /// the exact likelihoods, as summed by LogLikelihood
+  double BlockLogLikelihood(int b, const Gaussian *G);
+
+  /// Adds up the block log likelihoods in the order of LogLikelihood, the blocks are overwritten
+  static double AddLogLikelihoodBlocks(Array<double> &blocks);
+
+  /// Stores the log likelihood f and returns the relative change
+  double UpdateLogLikelihood(double f);
+
+  /// whether the Gaussian parameters are extrapolated from the last EM iterations, see Accelerate
+  bool _accelerate;
+
+  /// means and variances after the last plain EM iterations (SQUAREM) and their number
+  Array<double> _accel_theta0;
+  Array<double> _accel_theta1;
+  int _accel_count;
+
+  /// whether the last iteration started from extrapolated parameters, the parameters
+  /// and likelihood of the plain EM iteration these replaced
+  bool _accel_extrapolated;
+  Array<double> _accel_fallback;
+  double _accel_f;
+
 public:
+	/// number of active voxels per block of the M-step sums
+	enum { MStepBlockSize = 16384 };
+
 	/// Input mask
 	ByteImage _mask;
 
@@ -128,6 +252,9 @@ public:
 	template <class ImageType>
 	void addProbabilityMap(ImageType image);
 
+	// add the maps of a probability maps file
+	void addProbabilityMaps(const ProbabilityMapsFile &file);
+
 	// add background
 	void addBackground();
 	template <class ImageType>
@@ -190,6 +317,40 @@ public:
     /// set mask
     void SetMask(ByteImage &mask);
 
+    /// store atlas and posteriors densely inside the mask (voxel x structure)
+    void SetDenseStorage(bool dense);
+
+    /// store per voxel inside the mask only the structures with prior above epsilon
+    void SetSparseStorage(double epsilon);
+
+    /// store atlas and posteriors inside the mask in memory-mapped files in directory (implies dense storage unless sparse)
+    void SetScratchDirectory(const char *directory);
+
+    /// keep the likelihoods of the last pass, e.g. to reuse those of the log likelihood in the next E-step
+    void SetLikelihoodCache(bool cache);
+
+    /// look up the likelihoods in a table of the distinct intensities of the active voxels, which
+    /// holds the same values as the exact evaluation
+    void SetLikelihoodTable(bool table);
+
+    /// sum the M-step statistics in the E-step pass over the voxels (and, in DrawEM, the log likelihood in the bias correction pass)
+    void SetFusedIteration(bool fused);
+
+    /// extrapolate the Gaussian parameters from the last EM iterations, see Accelerate
+    void SetAcceleration(bool accelerate);
+
+    /// Extrapolates the means and variances (SQUAREM) after two plain EM iterations, called
+    /// with the relative change of the log likelihood after each iteration. Falls back to plain EM
+    /// if the likelihood decreased after an extrapolation, returns the relative change to test for convergence
+    /// (1, not converged, if the parameters were extrapolated or restored). Only the parameters are
+    /// restored, so extrapolate is false unless the next two iterations depend on nothing but the
+    /// parameters (no bias field fitted, no MRF or PV correction of the posteriors)
+    double Accelerate(double rel_diff, bool extrapolate = true);
+
+    /// Restarts the extrapolation when the model changes (bias field, priors, MRF, ...), and restores
+    /// the plain EM parameters if the last iteration extrapolated them
+    void ResetAcceleration();
+
 	/// Set padding value
 	virtual void SetPadding(RealPixel);
 
@@ -214,6 +375,8 @@ public:
 
     /// Write probability map into a file
 	void WriteProbMap(int i, const char *filename);
+    /// Write the posteriors of the first labels.size() classes into a single probability maps file
+	void WriteProbMaps(const char *filename, const Array<int> &labels);
     /// Write Gaussian parameters into a file
 	void WriteGaussianParameters(const char *file_name, int flag = 0);
     /// Write image estimate
@@ -236,6 +399,9 @@ public:
 	virtual void GetMean(double *);
     /// return variances
     virtual void GetVariance(double *);
+    /// gets and sets the means followed by the variances of all structures
+    void GetParameters(Array<double> &theta) const;
+    void SetParameters(const Array<double> &theta);
 
     /// initialise GMM parameters
 	void InitialiseGMMParameters(int n);
@@ -264,10 +430,67 @@ inline void EMBase::addProbabilityMap(ImageType image){
 	_number_of_tissues = _atlas.GetNumberOfMaps();
 }
 
+inline void EMBase::addProbabilityMaps(const ProbabilityMapsFile &file){
+	_atlas.AddMaps(file);
+	_number_of_tissues = _atlas.GetNumberOfMaps();
+}
+
 inline void EMBase::NormalizeAtlas(){
 	_atlas.NormalizeAtlas();
 }
 
+inline void EMBase::SetDenseStorage(bool dense)
+{
+	_dense_storage = dense;
+}
+
+inline void EMBase::SetSparseStorage(double epsilon)
+{
+	_sparse_storage = true;
+	_sparse_epsilon = epsilon;
+}
+
+inline void EMBase::SetScratchDirectory(const char *directory)
+{
+	_scratch_directory = directory ? directory : "";
+}
+
+inline void EMBase::SetLikelihoodCache(bool cache)
+{
+	_cache_likelihoods = cache;
+	_likelihoods_valid = false;
+}
+
+inline void EMBase::SetLikelihoodTable(bool table)
+{
+	_likelihood_table = table;
+	_likelihoods_valid = false;
+}
+
+inline void EMBase::SetFusedIteration(bool fused)
+{
+	_fused_iteration = fused;
+	_mstep_sums_valid = false;
+}
+
+inline void EMBase::SetAcceleration(bool accelerate)
+{
+	_accelerate = accelerate;
+	_accel_count = 0;
+	_accel_extrapolated = false;
+}
+
+inline void EMBase::InvalidateLikelihoods()
+{
+	_likelihoods_valid = false;
+}
+
+inline const double *EMBase::GetCachedLikelihoods(int id) const
+{
+	if ((!_cache_likelihoods && !_likelihood_table) || !_likelihoods_valid) return NULL;
+	return &_likelihoods[static_cast<size_t>(_likelihood_rows[id]) * _number_of_tissues];
+}
+
 inline void EMBase::SetPadding(RealPixel padding)
 {
 	_padding = padding;
@@ -290,6 +513,24 @@ inline void EMBase::WriteSegmentation(const char *filename)
 
 inline const char* EMBase::NameOfClass() const { return "EMBase"; } 
 
+template <class Body>
+struct EMBase::FusedEStepBody
+{
+  EMBase                     *_em;
+  const Body                 *_body;
+  const ProbabilityPixel     *_posteriors;
+  int                         _offset;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    const int n = static_cast<int>(_em->_active.size());
+    for (int b = re.begin(); b != re.end(); ++b) {
+      (*_body)(blocked_range<int>(b * MStepBlockSize, min(n, (b + 1) * MStepBlockSize)));
+      _em->AddMStepBlockSums(b, _posteriors, _offset);
+    }
+  }
+};
+
 }
 
 #endif
@@ -43,6 +43,10 @@ public:
 	void Initialise(double mean, double var);
 	double Evaluate(double x) const;
 	double GetNorm() const;
+
+	/// Evaluates the n gaussians G at the m intensities x, the likelihood of
+	/// intensity i and gaussian k is written to likelihoods[i*n+k]
+	static void Evaluate(const Gaussian *G, int n, const double *x, int m, double *likelihoods);
 };
 
 
@@ -26,8 +26,10 @@
 
 #include "mirtk/Image.h"
 #include "mirtk/HashImage.h"
+#include "mirtk/Array.h"
 
 #include <vector>
+#include <string>
 
 
 /**
@@ -36,8 +38,42 @@ Atlas probability mapnr class
 
  */
 using namespace std;
+
 namespace mirtk {
 
+class ProbabilityMapsFile;
+
+#ifdef DRAWEM_UINT16_PROBABILITIES
+/**
+ * Probability in [0,1] stored as 16 bit fixed point, converted from and to double on access
+ */
+class Probability16
+{
+	unsigned short _value;
+
+public:
+	Probability16() : _value(0) {}
+	Probability16(double p) { *this = p; }
+
+	Probability16 &operator =(double p) {
+		if      (p <= 0) _value = 0;
+		else if (p >= 1) _value = 65535;
+		else _value = static_cast<unsigned short>(p * 65535.0 + 0.5);
+		return *this;
+	}
+
+	Probability16 &operator /=(double d) { return *this = static_cast<double>(*this) / d; }
+
+	operator double() const { return _value * (1.0 / 65535.0); }
+};
+
+/// Type of the row-wise stored probabilities
+typedef Probability16 ProbabilityPixel;
+#else
+/// Type of the row-wise stored probabilities
+typedef RealPixel ProbabilityPixel;
+#endif
+
 
 class HashProbabilisticAtlas : public Object
 {
@@ -63,6 +99,69 @@ class HashProbabilisticAtlas : public Object
 	// whether we have background
  	bool _has_background;
 
+	// whether the maps are stored row-wise for the masked voxels instead of in hash images
+	bool _compact;
+
+	// whether rows only keep the structures with probability above _epsilon
+	bool _sparse;
+
+	// Probabilities up to this value are not kept in sparse rows
+	double _epsilon;
+
+	// Probabilities of all rows, the values of one voxel are contiguous
+	Array<ProbabilityPixel> _values;
+
+	// Directory of the scratch files the rows are memory-mapped from (empty for rows in _values)
+	string _scratch_directory;
+
+	// Probabilities of all rows, in _values or in the mapped scratch file
+	ProbabilityPixel *_data;
+
+	// Mapped scratch file of the rows (NULL for rows in memory) and its size in bytes
+	void *_mapped;
+	size_t _mapped_bytes;
+
+	// Unmaps the scratch file of the rows
+	void Unmap();
+
+	// Stores a copy of n row values in memory or in a new scratch file
+	void StoreValues(const ProbabilityPixel *values, size_t n);
+
+	// First value of each row, the last entry is the total number of values
+	Array<size_t> _offsets;
+
+	// Structures of the values of sparse rows, dense rows hold all maps and have no labels
+	Array<int> _labels;
+
+	// First label of each row
+	Array<size_t> _label_offsets;
+
+	// Row of each voxel (-1 outside of the mask)
+	Array<int> _rows;
+
+	// Number of rows (masked voxels)
+	int _number_of_rows;
+
+	// Attributes of the probability maps
+	ImageAttributes _attributes;
+
+	// Returns pointer to the stored value of a map at a voxel (NULL if not stored)
+	ProbabilityPixel *Find(int index, unsigned int mapnr) const;
+
+	// Exits on a non-zero value for a structure that is not stored at the voxel
+	void NotStored(unsigned int mapnr) const;
+
+	// Converts the maps into rows for the masked voxels. The structures of a row are
+	// those of the pattern row if given (plus the extra map where above _epsilon),
+	// otherwise those above _epsilon. All maps are kept if _sparse is false.
+	void Compact(const Array<int> &rows, int number_of_rows, const HashProbabilisticAtlas *pattern, const HashRealImage *extra);
+
+	// Returns the probability map converted from the rows
+	HashRealImage GetCompactImage(unsigned int mapnr) const;
+
+	// Appends a hashed map (taking ownership) as AddImage
+	void AddHashImage(HashRealImage *image);
+
 public:
 
 	// Constructor
@@ -71,9 +170,18 @@ public:
 	// Destructor
 	~HashProbabilisticAtlas();
 
-	// Copy operator
+	// Copy constructor
+	HashProbabilisticAtlas(const HashProbabilisticAtlas &atlas);
+
+	// Copy operator, the copy keeps its own scratch directory or uses the one of atlas
 	HashProbabilisticAtlas& operator=(const HashProbabilisticAtlas &atlas);
 
+	// Exchanges the maps (and their storage) with those of atlas without copying them
+	void Swap(HashProbabilisticAtlas &atlas);
+
+	// Store the rows of MakeDense/MakeSparse in memory-mapped files in directory instead of memory
+	void SetScratchDirectory(const char *directory);
+
 	// swap images within atlas
 	void SwapImages(int, int);
 
@@ -81,6 +189,9 @@ public:
 	template <class ImageType>
     void AddImage(ImageType image);
 
+	// Adds all maps of a probability maps file, hashed straight from the mapped values
+	void AddMaps(const ProbabilityMapsFile &file);
+
 	// Moves pointers in all images to the first voxel
 	void First();
 
@@ -99,9 +210,55 @@ public:
 	// Sets intensity value at _position
 	void SetValue(int x, int y, int z, unsigned int mapnr, RealPixel value);
 
+	// Returns intensity value at voxel index, does not move the pointer
+	RealPixel Get(int index, unsigned int mapnr) const;
+
+	// Sets intensity value at voxel index, does not move the pointer.
+	// Hash images must not be modified by concurrent threads, except for different maps.
+	// Sparse rows only take non-zero values for their stored structures (see MakeDense).
+	void Put(int index, unsigned int mapnr, RealPixel value);
+
+	// Returns number of values stored at pointer (0 outside of the mask)
+	int GetNumberOfValues() const;
+
+	// Returns pointer to the values stored at pointer (NULL outside of the mask)
+	ProbabilityPixel *GetValues();
+
+	// Returns the structures of the values stored at pointer (NULL for dense rows, where value j is structure j)
+	const int *GetLabels() const;
+
+	// Returns number of values stored at voxel index (0 outside of the mask)
+	int GetNumberOfValues(int index) const;
+
+	// Returns pointer to the values stored at voxel index (NULL outside of the mask)
+	ProbabilityPixel *GetValues(int index);
+
+	// Returns the structures of the values stored at voxel index
+	const int *GetLabels(int index) const;
+
 	// Returns number of voxels
     int GetNumberOfVoxels() const;
 
+	// Stores all maps row-wise for the voxels inside the mask, values outside are dropped
+	void MakeDense(const ByteImage &mask);
+
+	// Stores per voxel inside the mask only the structures with probability above epsilon.
+	// The structures of each voxel are copied from pattern if given. Rows where many structures
+	// are active are stored densely.
+	void MakeSparse(const ByteImage &mask, double epsilon, const HashProbabilisticAtlas *pattern = NULL);
+
+	// Whether the maps are stored row-wise (dense or sparse)
+	bool IsCompact() const;
+
+	// Whether the maps are stored row-wise with all structures for each voxel
+	bool IsDense() const;
+
+	// Whether the maps are stored row-wise with the active structures of each voxel
+	bool IsSparse() const;
+
+	// Returns the threshold of sparse rows
+	double GetEpsilon() const;
+
 	// Add probability maps
 	template <class ImageType>
     void AddProbabilityMaps(int, ImageType **atlas);
@@ -125,6 +282,9 @@ public:
 	// Write
 	void Write(int, const char *);
 
+	// Writes the first labels.size() maps into a single probability maps file
+	void WriteProbabilityMaps(const char *filename, const Array<int> &labels) const;
+
 	// Computes hard segmentation
 	HashIntegerImage ComputeHardSegmentation();
 
@@ -152,6 +312,10 @@ inline void HashProbabilisticAtlas::Next(){
 }
 
 inline RealPixel HashProbabilisticAtlas::GetValue(unsigned int mapnr){
+	if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) {
+		const ProbabilityPixel *value = Find(_position, mapnr);
+		return value ? static_cast<RealPixel>(*value) : 0;
+	}
 	if (mapnr < _images.size()) return _images[mapnr]->Get(_position);
 	else {
 		cerr << "map identificator " << mapnr <<" out of range." <<endl;
@@ -160,6 +324,10 @@ inline RealPixel HashProbabilisticAtlas::GetValue(unsigned int mapnr){
 }
 
 inline RealPixel HashProbabilisticAtlas::GetValue(int x, int y, int z, unsigned int mapnr){
+	if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) {
+		const ProbabilityPixel *value = Find(x + _attributes._x * (y + _attributes._y * z), mapnr);
+		return value ? static_cast<RealPixel>(*value) : 0;
+	}
 	if (mapnr < _images.size()) return _images[mapnr]->Get(x,y,z);
 	else {
 		cerr << "map identificator " << mapnr <<" out of range." <<endl;
@@ -168,7 +336,12 @@ inline RealPixel HashProbabilisticAtlas::GetValue(int x, int y, int z, unsigned
 }
 
 inline void HashProbabilisticAtlas::SetValue(unsigned int mapnr, RealPixel value){
-	if (mapnr < _images.size()) _images[mapnr]->Put(_position, value);
+	if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) {
+		ProbabilityPixel *ptr = Find(_position, mapnr);
+		if (ptr) *ptr = value;
+		else if (value != 0) NotStored(mapnr);
+	}
+	else if (mapnr < _images.size()) _images[mapnr]->Put(_position, value);
 	else {
 		cerr << "map identificator " << mapnr << " out of range." <<endl;
 		exit(1);
@@ -176,13 +349,110 @@ inline void HashProbabilisticAtlas::SetValue(unsigned int mapnr, RealPixel value
 }
 
 inline void HashProbabilisticAtlas::SetValue(int x, int y, int z, unsigned int mapnr, RealPixel value){
-	if (mapnr < _images.size()) _images[mapnr]->Put(x,y,z, value);
+	if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) {
+		ProbabilityPixel *ptr = Find(x + _attributes._x * (y + _attributes._y * z), mapnr);
+		if (ptr) *ptr = value;
+		else if (value != 0) NotStored(mapnr);
+	}
+	else if (mapnr < _images.size()) _images[mapnr]->Put(x,y,z, value);
+	else {
+		cerr << "map identificator " << mapnr <<" out of range." <<endl;
+		exit(1);
+	}
+}
+
+inline ProbabilityPixel *HashProbabilisticAtlas::Find(int index, unsigned int mapnr) const{
+	const int row = _rows[index];
+	if (row < 0) return NULL;
+	const size_t begin = _offsets[row];
+	const size_t n = _offsets[row+1] - begin;
+	ProbabilityPixel *values = _data + begin;
+	if (n == static_cast<size_t>(_number_of_maps)) return values + mapnr;
+	const int *labels = &_labels[_label_offsets[row]];
+	for (size_t j = 0; j < n; j++) {
+		if (labels[j] == static_cast<int>(mapnr)) return values + j;
+		if (labels[j] >  static_cast<int>(mapnr)) break;
+	}
+	return NULL;
+}
+
+inline RealPixel HashProbabilisticAtlas::Get(int index, unsigned int mapnr) const{
+	if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) {
+		const ProbabilityPixel *value = Find(index, mapnr);
+		return value ? static_cast<RealPixel>(*value) : 0;
+	}
+	if (mapnr < _images.size()) return _images[mapnr]->Get(index);
 	else {
 		cerr << "map identificator " << mapnr <<" out of range." <<endl;
 		exit(1);
 	}
 }
 
+inline void HashProbabilisticAtlas::Put(int index, unsigned int mapnr, RealPixel value){
+	if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) {
+		ProbabilityPixel *ptr = Find(index, mapnr);
+		if (ptr) *ptr = value;
+		else if (value != 0) NotStored(mapnr);
+	}
+	else if (mapnr < _images.size()) _images[mapnr]->Put(index, value);
+	else {
+		cerr << "map identificator " << mapnr <<" out of range." <<endl;
+		exit(1);
+	}
+}
+
+inline int HashProbabilisticAtlas::GetNumberOfValues(int index) const{
+	const int row = _rows[index];
+	return (row < 0) ? 0 : static_cast<int>(_offsets[row+1] - _offsets[row]);
+}
+
+inline ProbabilityPixel *HashProbabilisticAtlas::GetValues(int index){
+	if (!_compact) {
+		cerr << "HashProbabilisticAtlas::GetValues: maps are not stored row-wise" << endl;
+		exit(1);
+	}
+	const int row = _rows[index];
+	return (row < 0) ? NULL : _data + _offsets[row];
+}
+
+inline const int *HashProbabilisticAtlas::GetLabels(int index) const{
+	const int row = _rows[index];
+	if (row < 0 || _offsets[row+1] - _offsets[row] == static_cast<size_t>(_number_of_maps)) return NULL;
+	return &_labels[_label_offsets[row]];
+}
+
+inline int HashProbabilisticAtlas::GetNumberOfValues() const{
+	return GetNumberOfValues(_position);
+}
+
+inline ProbabilityPixel *HashProbabilisticAtlas::GetValues(){
+	return GetValues(_position);
+}
+
+inline const int *HashProbabilisticAtlas::GetLabels() const{
+	return GetLabels(_position);
+}
+
+inline bool HashProbabilisticAtlas::IsCompact() const{
+	return _compact;
+}
+
+inline void HashProbabilisticAtlas::SetScratchDirectory(const char *directory){
+	_scratch_directory = directory ? directory : "";
+}
+
+inline bool HashProbabilisticAtlas::IsDense() const{
+	return _compact && !_sparse;
+}
+
+inline bool HashProbabilisticAtlas::IsSparse() const{
+	return _sparse;
+}
+
+inline double HashProbabilisticAtlas::GetEpsilon() const{
+	return _epsilon;
+}
+
 inline int HashProbabilisticAtlas::GetNumberOfVoxels() const{
 	return _number_of_voxels;
 }
@@ -202,6 +472,7 @@ inline void HashProbabilisticAtlas::AddBackground(ImageType image){
 }
 
 inline HashRealImage HashProbabilisticAtlas::GetImage(unsigned int mapnr) const{
+    if (_compact && mapnr < static_cast<unsigned int>(_number_of_maps)) return GetCompactImage(mapnr);
     if (mapnr < _images.size()) return *_images[mapnr];
     else {
         cerr << "map identificator " << mapnr <<" out of range." <<endl;
@@ -211,6 +482,10 @@ inline HashRealImage HashProbabilisticAtlas::GetImage(unsigned int mapnr) const{
 
 inline HashRealImage::DataIterator HashProbabilisticAtlas::Begin(unsigned int mapnr) const
 {
+    if (_compact) {
+        cerr << "HashProbabilisticAtlas::Begin: maps are stored row-wise" << endl;
+        exit(1);
+    }
     if (mapnr < _images.size()) return _images[mapnr]->Begin();
     else {
         cerr << "map identificator " << mapnr <<" out of range." <<endl;
@@ -219,6 +494,10 @@ inline HashRealImage::DataIterator HashProbabilisticAtlas::Begin(unsigned int ma
 }
 inline HashRealImage::DataIterator HashProbabilisticAtlas::End(unsigned int mapnr) const
 {
+    if (_compact) {
+        cerr << "HashProbabilisticAtlas::End: maps are stored row-wise" << endl;
+        exit(1);
+    }
     if (mapnr < _images.size()) return _images[mapnr]->End();
     else {
         cerr << "map identificator " << mapnr <<" out of range." <<endl;
@@ -22,6 +22,7 @@
 #define MIRTKPOLYNOMIALBIASFIELD_H_
 
 #include "mirtk/BiasField.h"
+#include "mirtk/Array.h"
 
 namespace mirtk {
 
@@ -34,20 +35,66 @@ private:
 	double* _coeff;
 	int _numOfCoefficients;
 
+	/// Only every _stride-th point is used for the least square fit
+	int _stride;
+
+	/// Block sums of the normal equations, kept between fits
+	Array<double> _normal_equations;
+
+	/// Weighted least square fit to the samples if given, otherwise to the points in the arrays
+	void FitNormalEquations(const BiasFieldSamples *samples, double *x1, double *y1, double *z1, double *bias, double *weights, int no);
+
 public:
+	/// Number of points of which the normal equations are summed by one task
+	static const int NormalEquationsBlockSize = 16384;
+
+	/// Number of points of a row evaluated from the same forward differences
+	static const int RowBlockSize = 32;
+
+	/// Highest degree evaluated by forward differences
+	static const int MaxRowDegree = 15;
+
 	PolynomialBiasField();
 
 	/**
 	 * @param dop max degree of polynomial
+	 * @param stride use every stride-th point for the least square fit
 	 */
-	PolynomialBiasField(const GreyImage &image, int dop);
+	PolynomialBiasField(const GreyImage &image, int dop, int stride = 3);
 	~PolynomialBiasField();
 
-	/// Calculate weighted least square fit of polynomial to data
+	/// Calculate weighted least square fit of polynomial to data. The normal equations
+	/// are summed over blocks of points in parallel and solved by Cholesky decomposition.
 	virtual void WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no);
 
+	/// Calculate weighted least square fit of polynomial to the voxels, the coordinates are
+	/// computed on the fly and no memory is allocated once the block sums have their size
+	virtual void WeightedLeastSquares(const BiasFieldSamples &samples);
+
+	/// Sets the subsampling of the points of the least square fit
+	void SetStride(int stride);
+
+	/// Returns the subsampling of the points of the least square fit
+	int GetStride() const;
+
 	double Bias(double, double, double);
 
+	/// Calculate the bias along a row of points by forward differences of the polynomial,
+	/// which are seeded again every RowBlockSize points
+	virtual void BiasRow(const double *p, const double *d, int n, double *bias);
+
+	using BiasField::Get;
+	using BiasField::Put;
+
+	/// Returns the number of coefficients of the polynomial
+	virtual int NumberOfDOFs() const;
+
+	/// Gets a coefficient of the polynomial
+	virtual double Get(int) const;
+
+	/// Puts a coefficient of the polynomial
+	virtual void Put(int, double);
+
 	double Approximate(double *, double *, double *, double *, int);
 	void Interpolate(double* dbias);
 
@@ -68,6 +115,39 @@ private:
 	int getNumberOfCoefficients(int dop);
 };
 
+inline void PolynomialBiasField::SetStride(int stride)
+{
+	_stride = max(1, stride);
+}
+
+inline int PolynomialBiasField::GetStride() const
+{
+	return _stride;
+}
+
+inline int PolynomialBiasField::NumberOfDOFs() const
+{
+	return _numOfCoefficients;
+}
+
+inline double PolynomialBiasField::Get(int index) const
+{
+	if (index < 0 || index >= _numOfCoefficients) {
+		cerr << "PolynomialBiasField::Get: No such coefficient" << endl;
+		exit(1);
+	}
+	return _coeff[index];
+}
+
+inline void PolynomialBiasField::Put(int index, double value)
+{
+	if (index < 0 || index >= _numOfCoefficients) {
+		cerr << "PolynomialBiasField::Put: No such coefficient" << endl;
+		exit(1);
+	}
+	_coeff[index] = value;
+}
+
 }
 
 #endif /* MIRTKPOLYNOMIALBIASFIELD_H_ */
@@ -0,0 +1,128 @@
+/*
+ * Developing brain Region Annotation With Expectation-Maximization (Draw-EM)
+ *
+ * Copyright 2013-2020 Imperial College London
+ * Copyright 2013-2020 Antonios Makropoulos
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ProbabilityMapsFile_H
+
+#define _ProbabilityMapsFile_H
+
+#include "mirtk/Object.h"
+
+#include "mirtk/Image.h"
+#include "mirtk/Array.h"
+
+#include <cstdio>
+#include <functional>
+
+
+namespace mirtk {
+
+/**
+ * Single file of several probability maps of the same image lattice (extension .pmaps)
+ *
+ * The header holds the image attributes (with the scanner matrix) and the label id of each
+ * map, followed (at a page boundary) by the maps as uncompressed 32 bit floats in native
+ * byte order, one map after the other. Files are memory-mapped for reading, maps are appended for writing.
+ */
+class ProbabilityMapsFile : public Object
+{
+	mirtkObjectMacro(ProbabilityMapsFile);
+
+	/// Attributes of the maps
+	ImageAttributes _attributes;
+
+	/// Label id of each map
+	Array<int> _labels;
+
+	/// Mapped file and its size in bytes
+	void *_mapped;
+	size_t _mapped_bytes;
+
+	/// First map in the mapped file
+	const float *_maps;
+
+	/// File the maps are written to and the number of maps written
+	FILE *_output;
+	int _written;
+
+public:
+
+	/// Constructor
+	ProbabilityMapsFile();
+
+	/// Destructor
+	~ProbabilityMapsFile();
+
+	/// Whether the file name has the extension of probability maps files
+	static bool IsProbabilityMapsFile(const char *filename);
+
+	/// Maps a file for reading
+	void Read(const char *filename);
+
+	/// Creates a file for the maps with the given labels, the maps are added with WriteMap
+	void Create(const char *filename, const ImageAttributes &attributes, const Array<int> &labels);
+
+	/// Appends the next map
+	void WriteMap(const float *values);
+	void WriteMap(const RealImage &image);
+
+	/// Unmaps the file read or completes the file written
+	void Close();
+
+	/// Number of maps
+	int GetNumberOfMaps() const;
+
+	/// Label id of map k
+	int GetLabel(int k) const;
+
+	/// Label ids of all maps
+	const Array<int> &GetLabels() const;
+
+	/// Attributes of the maps
+	const ImageAttributes &Attributes() const;
+
+	/// Values of map k in the mapped file
+	const float *GetMap(int k) const;
+
+	/// Map k as image
+	RealImage GetImage(int k) const;
+
+	/// Loads n maps, from this file if read or else from the n image files, and passes them
+	/// in order to add(i, image). Batches of maps (by default one per thread) are loaded concurrently.
+	void ReadImages(char **filenames, int n, std::function<void(int, RealImage &)> add, int batch = 0) const;
+};
+
+inline int ProbabilityMapsFile::GetNumberOfMaps() const{
+	return static_cast<int>(_labels.size());
+}
+
+inline int ProbabilityMapsFile::GetLabel(int k) const{
+	return _labels[k];
+}
+
+inline const Array<int> &ProbabilityMapsFile::GetLabels() const{
+	return _labels;
+}
+
+inline const ImageAttributes &ProbabilityMapsFile::Attributes() const{
+	return _attributes;
+}
+
+}
+
+#endif
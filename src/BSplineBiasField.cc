@@ -20,6 +20,7 @@
 
 //#include "mirtk/BiasField.h"
 #include "mirtk/BSplineBiasField.h"
+#include "mirtk/Parallel.h"
 
 namespace mirtk {
 
@@ -647,174 +648,296 @@ double BSplineBiasField::Approximate(double *x1, double *y1, double *z1, double
 	return error;
 }
 
-void BSplineBiasField::WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no)
-{
-	int index, i, j, k, ii, jj, kk, l, m, n, indx, indx1;
-	double b,w, s, t, u, x, y, z;
-	Vector P(_x*_y*_z),T(_x*_y*_z);
-	Matrix M(_x*_y*_z, _x*_y*_z);
-
-	std::cerr<<_x<<" "<<_y<<" "<< _z<<std::endl;
+// Each control point interacts in the normal equations with the 7x7x7 control points
+// around it, the coefficients of a row are stored for all of them
+static const int    StencilWidth  = 7;
+static const int    StencilSize   = StencilWidth * StencilWidth * StencilWidth;
+static const int    StencilCenter = StencilSize / 2;
 
-	std::cerr<<"Starting weighted least squares...";
+// Stopping criteria of the conjugate gradients
+static const int    CGMaxIterations = 1000;
+static const double CGTolerance     = 1e-8;
 
-	int per=0;
-
-	for (index = 0; index < no; index++) {
-		if (index*10/no > per) {
-			per++;
-			std::cerr<<per<<"0%...";
+/// Points of a least square fit, from arrays or generated from the voxels of the samples
+struct BSplineFitPoints
+{
+	const BiasFieldSamples *_samples;
+	const double *_x;
+	const double *_y;
+	const double *_z;
+	const double *_bias;
+	const double *_weights;
+
+	/// Returns false if point r is not fitted, otherwise its world coordinates, bias and weight
+	bool Get(int r, double &x, double &y, double &z, double &b, double &w) const
+	{
+		if (_samples) {
+			const int index = _samples->Index(r);
+			if (index < 0) return false;
+			w = _samples->_weights[index];
+			if (w == 0) return false;
+			_samples->World(index, x, y, z);
+			b = _samples->_target[index] - (double) _samples->_reference[index];
+		} else {
+			w = _weights[r];
+			if (w == 0) return false;
+			x = _x[r];
+			y = _y[r];
+			z = _z[r];
+			b = _bias[r];
 		}
-		//std::cerr<<index<<" "<<std::endl;
-		x = x1[index];
-		y = y1[index];
-		z = z1[index];
-		b = bias[index];
-		w = weights[index];
-
-		//std::cerr<<x<<" "<<y<<" "<<z<<std::endl;
-
-		this->WorldToLattice(x, y, z);
-
-		///this must be added because of small numerical errors introduced by change between the coordinate systems
-		if (x<0) x=0;
-		if (y<0) y=0;
-		if (z<0) z=0;
-		if (x>_x-1) x=_x-1;
-		if (y>_y-1) y=_y-1;
-		if (z>_z-1) z=_z-1;
-
-		l = (int)floor(x);
-		m = (int)floor(y);
-		n = (int)floor(z);
-		s = x-l;
-		t = y-m;
-		u = z-n;
+		return true;
+	}
+};
 
-		///Adjust parameters for x=_x,...
-		if (x==_x-1) {
-			l=_x-2;
-			s=1;
-		}
-		if (y==_y-1) {
-			m=_y-2;
-			t=1;
-		}
+/// Sums the normal equations of the points of every fourth plane of cells, starting with
+/// _first_plane. The points of a cell plane only touch the rows of four control point planes,
+/// hence the cell planes of a task are written by no other task.
+struct BSplineNormalEquationsBody
+{
+	const BSplineBiasField *_field;
+	const BSplineFitPoints *_points;
+	const int              *_order;
+	const int              *_plane_start;
+	int                     _first_plane;
+	int                     _x, _y, _z;
+	double                 *_M;
+	double                 *_P;
+
+	void operator ()(const blocked_range<int> &re) const
+	{
+		int ind[64], loc[64], first[3], n;
+		double v[64], bx[4], by[4], bz[4];
+		double x, y, z, b, w;
+		for (int c = re.begin(); c != re.end(); ++c) {
+			const int plane = _first_plane + 4 * c;
+			for (int o = _plane_start[plane]; o < _plane_start[plane+1]; o++) {
+				_points->Get(_order[o], x, y, z, b, w);
+				_field->WorldToLattice(x, y, z);
+				BSplineBiasField::BasisValues(x, _x, first[0], bx);
+				BSplineBiasField::BasisValues(y, _y, first[1], by);
+				BSplineBiasField::BasisValues(z, _z, first[2], bz);
+
+				// control points with non-zero basis, their position in the 4x4x4 neighbourhood
+				n = 0;
+				for (int k = 0; k < 4; k++) {
+					const int kk = first[2] + k;
+					if (kk < 0 || kk >= _z) continue;
+					for (int j = 0; j < 4; j++) {
+						const int jj = first[1] + j;
+						if (jj < 0 || jj >= _y) continue;
+						for (int i = 0; i < 4; i++) {
+							const int ii = first[0] + i;
+							if (ii < 0 || ii >= _x) continue;
+							ind[n] = ii + _x * (jj + _y * kk);
+							loc[n] = i + StencilWidth * (j + StencilWidth * k);
+							v[n] = bx[i] * by[j] * bz[k];
+							n++;
+						}
+					}
+				}
 
-		if (z==_z-1) {
-			n=_z-2;
-			u=1;
+				// upper triangle, the control points are in increasing order
+				for (int p = 0; p < n; p++) {
+					const double wp = w * v[p];
+					_P[ind[p]] += wp * b;
+					double *row = _M + static_cast<size_t>(ind[p]) * StencilSize + StencilCenter - loc[p];
+					for (int q = p; q < n; q++) row[loc[q]] += wp * v[q];
+				}
+			}
 		}
+	}
+};
 
-		//std::cerr<<s<<" "<<t<<" "<<u<<" "<<w<<" "<<b<<std::endl;
-
-
-		for (k = 0; k < 4; k++) {
-			for (j = 0; j < 4; j++) {
-				for (i = 0; i < 4; i++) {
+/// Multiplies the banded normal matrix with a vector, one plane of control points per task
+struct BSplineMatVecBody
+{
+	const double *_M;
+	const double *_v;
+	double       *_result;
+	int           _x, _y, _z;
 
-					indx=Ind(i+l-1, j+m-1, k+n-1);
-					if ((indx >= 0) && (indx <_x*_y*_z)) {
-						//P(indx) += b*B(i, s) * B(j, t) * B(k, u)*w;
-						P(indx) += b*N(i+l-1,x,_x) * N(j+m-1,y,_y) * N(k+n-1,z,_z)*w;
-					} else {
-						//std::cerr<<"out of range:"<< i+l-1<<" "<<j+m-1<<" "<<k+n-1<<std::endl;
-					}
-					//std::cerr<<i+l-1<<" "<<j+m-1<<" "<<k+n-1<<std::endl;
-					for (kk = 0; kk < 4; kk++) {
-						for (jj = 0; jj < 4; jj++) {
-							for (ii = 0; ii < 4; ii++) {
-								indx1=Ind(ii+l-1, jj+m-1, kk+n-1);
-								if ((indx >= 0) && (indx <_x*_y*_z) && (indx1 >= 0) && (indx1 <_x*_y*_z)) {
-									M(indx,indx1)
-                		  //+= B(i, s) * B(j, t) * B(k, u) * B(ii, s) * B(jj, t) * B(kk, u)*w;
-                		  += N(i+l-1,x,_x) * N(j+m-1,y,_y) * N(k+n-1,z,_z)*N(ii+l-1,x,_x) * N(jj+m-1,y,_y) * N(kk+n-1,z,_z)*w;
-								} else {
-									//std::cerr<<"out of range:"<< i+l-1<<" "<<j+m-1<<" "<<k+n-1<< ii+l-1<<" "<<jj+m-1<<" "<<kk+n-1<<std::endl;
-								}
+	void operator ()(const blocked_range<int> &re) const
+	{
+		const int h = StencilWidth / 2;
+		for (int k = re.begin(); k != re.end(); ++k) {
+			for (int j = 0; j < _y; j++) {
+				for (int i = 0; i < _x; i++) {
+					const int p = i + _x * (j + _y * k);
+					const double *row = _M + static_cast<size_t>(p) * StencilSize;
+					double sum = 0;
+					for (int dk = max(-h, -k); dk <= min(h, _z-1-k); dk++) {
+						for (int dj = max(-h, -j); dj <= min(h, _y-1-j); dj++) {
+							const int q = p + _x * (dj + _y * dk);
+							const double *m = row + StencilWidth * (dj + h + StencilWidth * (dk + h)) + h;
+							for (int di = max(-h, -i); di <= min(h, _x-1-i); di++) {
+								sum += m[di] * _v[q + di];
 							}
 						}
 					}
-
+					_result[p] = sum;
 				}
 			}
 		}
-
 	}
+};
 
-	M.Invert();
-	P=M*P;
-
-
-	/*
-    for (i=0;i<_x*_y*_z; i++)
-    for (j=0;j<_x*_y*_z; j++) {
-      T(i)+=M(i,j);
-    }
-  //M.Print();
-
-  std::cerr<<"Right side:"<<std::endl;
-  //P.Print();
-
-  std::cerr<<"Singular value decomposition:"<<std::endl;
-
-  double **aa, *ww, **vv, *pp, *xx;
-  //int *ind;
-  int rows = _x*_y*_z;
+void BSplineBiasField::BasisValues(double u, int L, int &first, double *values)
+{
+	// as in the least square fit, clamped to the lattice
+	if (u < 0) u = 0;
+	if (u > L-1) u = L-1;
+	int l = (int)floor(u);
+	double t = u - l;
+	if (l == L-1) {
+		l = L-2;
+		t = 1;
+	}
+	first = l - 1;
+	if (l > 1 && l < L-3) {
+		// uniform B-spline away from the boundary
+		const double *lut = LookupTable[(int)round(t * LUTSIZE)];
+		for (int i = 0; i < 4; i++) values[i] = lut[i];
+	} else {
+		for (int i = 0; i < 4; i++) values[i] = N(first + i, u, L);
+	}
+}
 
-  // Allocate memory
-  aa = dmatrix(1, rows, 1, rows);
-  vv = dmatrix(1, rows, 1, rows);
-  ww = dvector(1, rows);
-  pp = dvector(1, rows);
-  xx = dvector(1, rows);
+void BSplineBiasField::WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no)
+{
+	BSplineFitPoints points;
+	points._samples = NULL;
+	points._x = x1;
+	points._y = y1;
+	points._z = z1;
+	points._bias = bias;
+	points._weights = weights;
+	FitNormalEquations(points, no);
+}
 
-  // Convert matrix to NR format
-  M.Matrix2NR(aa);
-  P.Vector2NR(pp);
+void BSplineBiasField::WeightedLeastSquares(const BiasFieldSamples &samples)
+{
+	BSplineFitPoints points;
+	points._samples = &samples;
+	points._x = points._y = points._z = points._bias = points._weights = NULL;
+	FitNormalEquations(points, samples._number_of_voxels);
+}
 
-  //ind = ivector(1, rows);
+void BSplineBiasField::FitNormalEquations(const BSplineFitPoints &points, int no)
+{
+	int r, k;
+	double x, y, z, b, w;
+	const int rows = _x*_y*_z;
+	const int planes = max(1, _z-1);
 
-  svdcmp(aa, rows, rows, ww, vv);
+	std::cerr<<"Starting weighted least squares ("<<_x<<" x "<<_y<<" x "<<_z<<" control points)...";
 
- // for (j = 1; j <= rows; j++)  std::cerr <<ww[j]<<std::endl;
+	// sort the points by the plane of their lattice cell
+	_plane_start.assign(planes + 1, 0);
+	for (r = 0; r < no; r++) {
+		if (!points.Get(r, x, y, z, b, w)) continue;
+		this->WorldToLattice(x, y, z);
+		_plane_start[CellPlane(z) + 1]++;
+	}
+	for (k = 0; k < planes; k++) _plane_start[k+1] += _plane_start[k];
+	_point_order.resize(_plane_start[planes]);
+	Array<int> next(_plane_start.begin(), _plane_start.end() - 1);
+	for (r = 0; r < no; r++) {
+		if (!points.Get(r, x, y, z, b, w)) continue;
+		this->WorldToLattice(x, y, z);
+		_point_order[next[CellPlane(z)]++] = r;
+	}
 
+	// banded normal equations, cell planes four apart write disjoint rows
+	_normal_matrix.assign(static_cast<size_t>(rows) * StencilSize, 0);
+	Array<double> P(rows, 0);
+	BSplineNormalEquationsBody body;
+	body._field = this;
+	body._points = &points;
+	body._order = _point_order.data();
+	body._plane_start = _plane_start.data();
+	body._x = _x;
+	body._y = _y;
+	body._z = _z;
+	body._M = _normal_matrix.data();
+	body._P = P.data();
+	for (int color = 0; color < 4 && color < planes; color++) {
+		body._first_plane = color;
+		parallel_for(blocked_range<int>(0, (planes - color + 3) / 4), body);
+	}
 
-  svbksb(aa,ww,vv,rows,rows,pp,xx);
-  P.NR2Vector(xx);
-  // Convert NR format back
-  //M.NR2Matrix();
+	// lower triangle from the upper one
+	double *M = _normal_matrix.data();
+	for (int p = 0; p < rows; p++) {
+		for (int s = 0; s < StencilCenter; s++) {
+			const int di = s % StencilWidth - 3, dj = s / StencilWidth % StencilWidth - 3, dk = s / (StencilWidth * StencilWidth) - 3;
+			const int i = p % _x + di, j = p / _x % _y + dj, kk = p / (_x * _y) + dk;
+			if (i < 0 || i >= _x || j < 0 || j >= _y || kk < 0 || kk >= _z) continue;
+			const int q = i + _x * (j + _y * kk);
+			M[static_cast<size_t>(p) * StencilSize + s] = M[static_cast<size_t>(q) * StencilSize + StencilSize - 1 - s];
+		}
+	}
 
-  // Deallocate memory
-  free_dmatrix(aa, 1, rows, 1, rows);
-  free_dmatrix(vv, 1, rows, 1, rows);
-  free_dvector(ww, 1,rows);
-  free_dvector(pp, 1,rows);
-  free_dvector(xx, 1,rows);
-  //free_ivector( ind, 1, rows);
-	 */
-	std::cerr<<"Resulting  control points:"<<std::endl;
-	for (k = 0; k < _z; k++) {
-		for (j = 0; j < _y; j++) {
-			for (i = 0; i < _x; i++) {
-				std::cerr<<P(Ind(i,j,k))<<" ";
-			}
-			std::cerr<<" ";
+	// conjugate gradients with Jacobi preconditioner, starting from the current control points;
+	// control points without data have empty rows and keep their value
+	Array<double> X(rows), R(rows), Z(rows), D(rows), Q(rows);
+	for (int p = 0; p < rows; p++) {
+		X[p] = _data[p / (_x * _y)][p / _x % _y][p % _x];
+		D[p] = M[static_cast<size_t>(p) * StencilSize + StencilCenter];
+	}
+	BSplineMatVecBody matvec;
+	matvec._M = M;
+	matvec._x = _x;
+	matvec._y = _y;
+	matvec._z = _z;
+	matvec._v = X.data();
+	matvec._result = Q.data();
+	parallel_for(blocked_range<int>(0, _z), matvec);
+
+	double norm = 0, rz = 0;
+	for (int p = 0; p < rows; p++) {
+		R[p] = (D[p] > 0) ? P[p] - Q[p] : 0;
+		Z[p] = (D[p] > 0) ? R[p] / D[p] : 0;
+		norm += P[p] * P[p];
+		rz += R[p] * Z[p];
+	}
+	Array<double> S(Z);
+	const double tolerance = CGTolerance * CGTolerance * norm;
+	int iteration = 0;
+	double rr = 0;
+	for (int p = 0; p < rows; p++) rr += R[p] * R[p];
+	while (iteration < CGMaxIterations && rr > tolerance) {
+		matvec._v = S.data();
+		parallel_for(blocked_range<int>(0, _z), matvec);
+		double sq = 0;
+		for (int p = 0; p < rows; p++) sq += S[p] * Q[p];
+		if (!(sq > 0)) break;
+		const double alpha = rz / sq;
+		double rz_new = 0;
+		rr = 0;
+		for (int p = 0; p < rows; p++) {
+			X[p] += alpha * S[p];
+			R[p] -= alpha * Q[p];
+			Z[p] = (D[p] > 0) ? R[p] / D[p] : 0;
+			rz_new += R[p] * Z[p];
+			rr += R[p] * R[p];
 		}
-		std::cerr<<std::endl;
+		const double beta = rz_new / rz;
+		rz = rz_new;
+		for (int p = 0; p < rows; p++) S[p] = Z[p] + beta * S[p];
+		iteration++;
 	}
+	std::cerr<<"done after "<<iteration<<" CG iterations"<<std::endl;
 
 	for (k = 0; k < _z; k++) {
-		for (j = 0; j < _y; j++) {
-			for (i = 0; i < _x; i++) {
-				_data[k][j][i] = P(Ind(i,j,k));
+		for (int j = 0; j < _y; j++) {
+			for (int i = 0; i < _x; i++) {
+				_data[k][j][i] = X[i + _x * (j + _y * k)];
 			}
 		}
 	}
 }
 
-
-
 void BSplineBiasField::Interpolate(double* dbias)
 {
 	RealImage coeffs;
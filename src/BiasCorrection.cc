@@ -19,8 +19,71 @@
 
 
 #include "mirtk/BiasCorrection.h"
+#include "mirtk/Parallel.h"
 namespace mirtk {
 
+/// Image to world matrix, world = m * (i, j, k, 1), from the world coordinates of the
+/// origin and of unit voxel steps
+template <class VoxelType>
+static void GetImageToWorld(const GenericImage<VoxelType> &image, double m[3][4])
+{
+	double o[3], e[3];
+	o[0] = o[1] = o[2] = 0;
+	image.ImageToWorld(o[0], o[1], o[2]);
+	for (int c = 0; c < 3; c++) {
+		e[0] = (c == 0);
+		e[1] = (c == 1);
+		e[2] = (c == 2);
+		image.ImageToWorld(e[0], e[1], e[2]);
+		for (int r = 0; r < 3; r++) m[r][c] = e[r] - o[r];
+	}
+	for (int r = 0; r < 3; r++) m[r][3] = o[r];
+}
+
+/// Corrects the unpadded voxels of one slice per task, the bias is evaluated row by row
+template <class VoxelType>
+struct ApplyBiasBody
+{
+	enum Mode { Subtract, SubtractAndRound, Divide };
+
+	BiasField               *_biasfield;
+	GenericImage<VoxelType> *_image;
+	double                   _matI2W[3][4];
+	double                   _padding;
+	Mode                     _mode;
+	BiasCorrectionRows      *_rows;
+
+	void operator ()(const blocked_range<int> &re) const
+	{
+		const int nx = _image->GetX();
+		Array<double> bias(nx);
+		double p[3];
+		const double d[3] = { _matI2W[0][0], _matI2W[1][0], _matI2W[2][0] };
+		for (int k = re.begin(); k != re.end(); ++k) {
+			for (int j = 0; j < _image->GetY(); j++) {
+				for (int r = 0; r < 3; r++) p[r] = _matI2W[r][1] * j + _matI2W[r][2] * k + _matI2W[r][3];
+				_biasfield->BiasRow(p, d, nx, bias.data());
+				VoxelType *ptr = _image->GetPointerToVoxels(0, j, k);
+				for (int i = 0; i < nx; i++) {
+					if (ptr[i] == _padding) continue;
+					switch (_mode) {
+						case Subtract:
+							ptr[i] = static_cast<VoxelType>(ptr[i] - bias[i]);
+							break;
+						case SubtractAndRound:
+							ptr[i] = static_cast<VoxelType>(round(ptr[i] - bias[i]));
+							break;
+						case Divide:
+							ptr[i] = static_cast<VoxelType>(round(ptr[i] / exp(bias[i]/1000)));
+							break;
+					}
+				}
+				if (_rows) _rows->Row(j, k);
+			}
+		}
+	}
+};
+
 BiasCorrection::BiasCorrection()
 {
 	// Set parameters
@@ -35,6 +98,7 @@ BiasCorrection::BiasCorrection()
 
 	// mask
 	_mask = NULL;
+	_voxels = NULL;
 }
 
 BiasCorrection::~BiasCorrection()
@@ -56,9 +120,6 @@ void BiasCorrection::Finalize()
 
 void BiasCorrection::Run()
 {
-	int i, j, k, n;
-	RealPixel *ptr2target, *ptr2ref, *ptr2w;
-
 	if (_reference == NULL) {
 		cerr << "BiasCorrection::Run: Filter has no reference input" << endl;
 		exit(1);
@@ -77,135 +138,77 @@ void BiasCorrection::Run()
 	// Do the initial set up for all levels
 	this->Initialize();
 
-	// Compute no of unpadded voxels
-	n = 0;
-	ptr2target = _target->GetPointerToVoxels();
-	BytePixel *pm = _mask->GetPointerToVoxels();
-	for (i = 0; i < _target->GetNumberOfVoxels(); i++) {
-		if (*ptr2target != _Padding && *pm == 1 ) {
-			n++;
-		}
-		pm++;
-		ptr2target++;
-	}
+	// The fit computes the coordinates of the voxels from their indices
+	BiasFieldSamples samples;
+	samples._target = _target->GetPointerToVoxels();
+	samples._reference = _reference->GetPointerToVoxels();
+	samples._weights = _weights->GetPointerToVoxels();
+	samples._mask = _mask->GetPointerToVoxels();
+	samples._voxels = _voxels ? _voxels->data() : NULL;
+	samples._number_of_voxels = _voxels ? static_cast<int>(_voxels->size()) : _target->GetNumberOfVoxels();
+	samples._x = _target->GetX();
+	samples._y = _target->GetY();
+	samples._padding = _Padding;
 
-	double *x = new double[n];
-	double *y = new double[n];
-	double *z = new double[n];
-	double *b = new double[n];
-	double *w = new double[n];
-	n = 0;
-	ptr2target = _target->GetPointerToVoxels();
-	ptr2ref    = _reference->GetPointerToVoxels();
-	ptr2w      = _weights->GetPointerToVoxels();
-	pm = _mask->GetPointerToVoxels();
-	for (k = 0; k < _target->GetZ(); k++) {
-		for (j = 0; j < _target->GetY(); j++) {
-			for (i = 0; i < _target->GetX(); i++) {
-				if (*ptr2target != _Padding && *pm == 1) {
-					x[n] = i;
-					y[n] = j;
-					z[n] = k;
-					_target->ImageToWorld(x[n], y[n], z[n]);
-					b[n] = *ptr2target - (double) *ptr2ref;
-                    w[n] = *ptr2w;
-					n++;
-				}
-				pm++;
-				ptr2target++;
-				ptr2ref++;
-				ptr2w++;
-			}
-		}
-	}
+	GetImageToWorld(*_target, samples._matI2W);
 
 	cout << "Computing bias field ... ";
 	cout.flush();
 	// _biasfield->Approximate(x, y, z, b, n);
-	_biasfield->WeightedLeastSquares(x, y, z, b, w, n);
+	_biasfield->WeightedLeastSquares(samples);
 	cout << "done" << endl;
 
-	delete []x;
-	delete []y;
-	delete []z;
-	delete []b;
-
 	// Do the final cleaning up for all levels
 	this->Finalize();
 }
 
 void BiasCorrection::Apply(RealImage &image)
 {
-	int i, j, k;
-	double x, y, z, bias;
+	Apply(image, NULL);
+}
 
+void BiasCorrection::Apply(RealImage &image, BiasCorrectionRows *rows)
+{
 	// Default is the target image
 	image = *_target;
 
-	for (k = 0; k < image.GetZ(); k++) {
-		for (j = 0; j < image.GetY(); j++) {
-			for (i = 0; i < image.GetX(); i++) {
-				x = i;
-				y = j;
-				z = k;
-				image.ImageToWorld(x, y, z);
-				bias = _biasfield->Bias(x, y, z);
-                if (_target->Get(i, j, k) != _Padding ) {
-                //if (_mask->Get(i, j, k)  && _target->Get(i, j, k) != _Padding) {
-					//image(i, j, k) = round(image(i, j, k) - bias);
-					image(i, j, k) = image(i, j, k) - bias;
-					//if( image(i, j, k) < 0.0 ) image(i, j, k) = 0.0;
-				}
-			}
-		}
-	}
+	ApplyBiasBody<RealPixel> body;
+	body._biasfield = _biasfield;
+	body._image = &image;
+	GetImageToWorld(image, body._matI2W);
+	body._padding = _Padding;
+	body._mode = ApplyBiasBody<RealPixel>::Subtract;
+	body._rows = rows;
+	parallel_for(blocked_range<int>(0, image.GetZ()), body);
 }
 
 void BiasCorrection::ApplyToImage(RealImage &image)
 {
-	int i, j, k;
-	double x, y, z, bias;
 	cerr<<"Applying bias ...";
 	//cerr<<_biasfield;
 
-	for (k = 0; k < image.GetZ(); k++) {
-		for (j = 0; j < image.GetY(); j++) {
-			for (i = 0; i < image.GetX(); i++) {
-				x = i;
-				y = j;
-				z = k;
-				image.ImageToWorld(x, y, z);
-				bias = _biasfield->Bias(x, y, z);
-				if (image.Get(i, j, k) != _Padding) {
-					image(i, j, k) = round(image(i, j, k) - bias);
-				}
-			}
-
-		}
-	}
+	ApplyBiasBody<RealPixel> body;
+	body._biasfield = _biasfield;
+	body._image = &image;
+	GetImageToWorld(image, body._matI2W);
+	body._padding = _Padding;
+	body._mode = ApplyBiasBody<RealPixel>::SubtractAndRound;
+	body._rows = NULL;
+	parallel_for(blocked_range<int>(0, image.GetZ()), body);
 
 	cerr<<"done."<<endl;
 }
 
 void BiasCorrection::ApplyToImage(GreyImage &image)
 {
-	int i, j, k;
-	double x, y, z, bias;
-
-	for (k = 0; k < image.GetZ(); k++) {
-		for (j = 0; j < image.GetY(); j++) {
-			for (i = 0; i < image.GetX(); i++) {
-				x = i;
-				y = j;
-				z = k;
-				image.ImageToWorld(x, y, z);
-				bias = _biasfield->Bias(x, y, z);
-				if (image.Get(i, j, k) != _Padding) {
-					image(i, j, k) = static_cast<GreyPixel>(round(image(i, j, k) / exp(bias/1000)));
-				}
-			}
-		}
-	}
+	ApplyBiasBody<GreyPixel> body;
+	body._biasfield = _biasfield;
+	body._image = &image;
+	GetImageToWorld(image, body._matI2W);
+	body._padding = _Padding;
+	body._mode = ApplyBiasBody<GreyPixel>::Divide;
+	body._rows = NULL;
+	parallel_for(blocked_range<int>(0, image.GetZ()), body);
 }
 
 }
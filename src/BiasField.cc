@@ -158,6 +158,44 @@ Point BiasField::ControlPointLocation(int index) const
 	return p;
 }
 
+void BiasField::BiasRow(const double *p, const double *d, int n, double *bias)
+{
+	for (int i = 0; i < n; i++) {
+		bias[i] = this->Bias(p[0] + i * d[0], p[1] + i * d[1], p[2] + i * d[2]);
+	}
+}
+
+void BiasField::WeightedLeastSquares(const BiasFieldSamples &samples)
+{
+	int s, index, n = 0;
+	for (s = 0; s < samples._number_of_voxels; s++) {
+		if (samples.Index(s) >= 0) n++;
+	}
+
+	double *x = new double[n];
+	double *y = new double[n];
+	double *z = new double[n];
+	double *b = new double[n];
+	double *w = new double[n];
+	n = 0;
+	for (s = 0; s < samples._number_of_voxels; s++) {
+		index = samples.Index(s);
+		if (index < 0) continue;
+		samples.World(index, x[n], y[n], z[n]);
+		b[n] = samples._target[index] - (double) samples._reference[index];
+		w[n] = samples._weights[index];
+		n++;
+	}
+
+	this->WeightedLeastSquares(x, y, z, b, w, n);
+
+	delete []x;
+	delete []y;
+	delete []z;
+	delete []b;
+	delete []w;
+}
+
 void BiasField::ControlPointLocation(int index, double &x, double &y, double &z) const
 {
 	x = index/(_y*_z);
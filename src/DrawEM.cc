@@ -20,6 +20,16 @@
 
 
 #include "mirtk/DrawEM.h"
+#include "mirtk/Parallel.h"
+#include "mirtk/Cifstream.h"
+#include "mirtk/Cofstream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+#define DRAWEM_CHECKPOINT_MAGIC   815100
+#define DRAWEM_CHECKPOINT_VERSION 3
 
 namespace mirtk {
 
@@ -53,6 +63,12 @@ void DrawEM::InitialiseParameters(){
     wmlabel=4;
     mrfweight=1;
     bignn=false;
+    _mrf_update=MRFSequential;
+    _mrf_source=NULL;
+    _mrf_tolerance=0;
+    _mrf_full_sweep=5;
+    _mrf_sweep=0;
+    _biasfield=NULL;
 }
 
 
@@ -65,8 +81,10 @@ void DrawEM::SetInput(const RealImage &image, const Matrix &connectivity)
         std::cerr << "is:" << connectivity.Rows() << "x" << connectivity.Rows() << std::endl;
     }
     _connectivity = connectivity;
+    compileConnectivity();
 
     EMBase::SetInput(_uncorrected);
+    initMRFKernel();
 
 
     //SEG {
@@ -78,7 +96,7 @@ void DrawEM::SetInput(const RealImage &image, const Matrix &connectivity)
 }
 
 
-void DrawEM::BStep()
+void DrawEM::fitBiasField()
 {
     // Create bias correction filter
     _biascorrection.SetInput(&_uncorrected, &_estimate);
@@ -86,11 +104,107 @@ void DrawEM::BStep()
     _biascorrection.SetOutput(_biasfield);
     _biascorrection.SetPadding((short int) _padding);
     _biascorrection.SetMask(&_mask);
+    _biascorrection.SetVoxels(&_active);
     _biascorrection.Run();
+}
+
+void DrawEM::BStep()
+{
+    fitBiasField();
 
     // Generate bias corrected image for next iteration
     _input = _uncorrected;
     _biascorrection.Apply(_input);
+    InvalidateLikelihoods();
+    _mstep_sums_valid = false;
+}
+
+void DrawEM::ApplyBiasField()
+{
+    _biascorrection.SetInput(&_uncorrected, &_estimate);
+    _biascorrection.SetOutput(_biasfield);
+    _biascorrection.SetPadding((short int) _padding);
+
+    _input = _uncorrected;
+    _biascorrection.Apply(_input);
+    InvalidateLikelihoods();
+    _mstep_sums_valid = false;
+}
+
+/// Sums the M-step statistics and the log likelihood of each block of active voxels as soon as
+/// the bias field is applied to its last row, in the blocks of the unfused M-step and LogLikelihood
+struct DrawEM::CorrectedRows : public BiasCorrectionRows
+{
+    DrawEM                 *_em;
+    const Gaussian         *_G;
+    bool                    _mstep;
+    Array<std::atomic<int> > *_remaining;
+    Array<double>           _blocks;
+
+    void Row(int j, int k)
+    {
+        int begin, end;
+        _em->GetRowActiveVoxels(j, k, begin, end);
+        if (begin == end) return;
+        for (int b = begin / MStepBlockSize; b <= (end - 1) / MStepBlockSize; b++) {
+            // the thread correcting the last row of a block sums it
+            if (--(*_remaining)[b] > 0) continue;
+            if (_mstep) _em->AddMStepBlockSums(b);
+            if (_G) _blocks[b] = _em->BlockLogLikelihood(b, _G);
+        }
+    }
+};
+
+double DrawEM::applyBiasFieldSums(bool mstep, const Gaussian *G)
+{
+    // centred at the current means as in GetMStepSums
+    if (mstep) mstep = BeginMStepSums();
+
+    // number of rows with active voxels of each block
+    const int N = static_cast<int>(_active.size());
+    const int X = _input.GetX();
+    const int number_of_blocks = max(1, (N + MStepBlockSize - 1) / MStepBlockSize);
+    Array<std::atomic<int> > remaining(number_of_blocks);
+    for (int b = 0; b < number_of_blocks; b++) remaining[b] = 0;
+    for (int a = 0; a < N; a++) {
+        if (a % MStepBlockSize == 0 || _active[a] / X != _active[a-1] / X) remaining[a / MStepBlockSize]++;
+    }
+
+    CorrectedRows rows;
+    rows._em = this;
+    rows._G = G;
+    rows._mstep = mstep;
+    rows._remaining = &remaining;
+    rows._blocks.assign(number_of_blocks, 0.);
+    _input = _uncorrected;
+    _biascorrection.Apply(_input, &rows);
+
+    InvalidateLikelihoods();
+    if (mstep) EndMStepSums();
+    return G ? AddLogLikelihoodBlocks(rows._blocks) : 0;
+}
+
+double DrawEM::bStepLogLikelihood()
+{
+    int k;
+
+    fitBiasField();
+
+    Array<Gaussian> G(_number_of_tissues);
+    for (k = 0; k < _number_of_tissues; k++) {
+        G[k].Initialise( _mi[k], _sigma[k]);
+    }
+
+    // corrected image as in BStep, the log likelihood as in LogLikelihood
+    return -applyBiasFieldSums(false, G.data());
+}
+
+void DrawEM::bStepMStepSums()
+{
+    fitBiasField();
+
+    // corrected image as in BStep, the sums as in GetMStepSums
+    applyBiasFieldSums(true, NULL);
 }
 
 
@@ -103,8 +217,6 @@ void DrawEM::RStep(double rf)
 {
     double relaxFactor = rf;
 
-    _atlas.First();
-    _output.First();
     HashProbabilisticAtlas filteredAtlas;
 
     RealImage filterInput;
@@ -115,13 +227,12 @@ void DrawEM::RStep(double rf)
         filter.Input(&filterInput);
         filter.Output(&filterInput);
         filter.Run();
-        filteredAtlas.AddImage(filterInput);
+        if (_atlas.HasBackground() && k == _number_of_tissues-1) filteredAtlas.AddBackground(filterInput);
+        else filteredAtlas.AddImage(filterInput);
     }
 
-    filteredAtlas.First();
-    RealPixel *ptr = _input.GetPointerToVoxels();
-    BytePixel *pm = _mask.GetPointerToVoxels();
-
+    // sparse priors are relaxed in the filtered atlas, the active structures may change
+    bool sparse = _atlas.IsSparse();
 
     //mine
     bool bMRF = _number_of_tissues == _connectivity.Rows();
@@ -132,55 +243,66 @@ void DrawEM::RStep(double rf)
     Array<double> numerator(_number_of_tissues);
     Array<double> values(_number_of_tissues);
 
-    for (int i=0; i< _number_of_voxels; i++){
-        if (i*10.0/_number_of_voxels > per) {
+    const int N = static_cast<int>(_active.size());
+    for (int a=0; a< N; a++){
+        if (a*10.0/N > per) {
             per++;
             std::cerr<<per<<"0%...";
         }
+        const int i = _active[a];
         double denominator = 0.0;
-        if (*pm == 1){
-            for( int k = 0; k < _number_of_tissues; ++k ){
-                values[k]= (1.0-relaxFactor) * filteredAtlas.GetValue(k) + relaxFactor * _atlas.GetValue(k);
-                filteredAtlas.SetValue(k, values[k]);
-            }
+        for( int k = 0; k < _number_of_tissues; ++k ){
+            values[k]= (1.0-relaxFactor) * filteredAtlas.Get(i, k) + relaxFactor * _atlas.Get(i, k);
+            filteredAtlas.Put(i, k, values[k]);
+        }
 
-            for( int k = 0; k < _number_of_tissues; ++k ){
-                numerator[k] = .0;
-                double temp = .0;
+        // sum of all structures, the distant ones are subtracted per structure
+        double total = 0;
+        if(bMRF) for( int k = 0; k < _number_of_tissues; ++k ) total += values[k];
 
-                if(bMRF){
-                    for( int j = 0; j < _number_of_tissues; ++j ){
-                        if ( _connectivity(k,j) <= 1 ){
-                            temp += values[k] * values[j];
-                        }
-                    }
-                }else{
-                    temp = values[k];
-                }
-                numerator[k] += temp;
-                denominator += numerator[k];
-            }
+        for( int k = 0; k < _number_of_tissues; ++k ){
+            numerator[k] = .0;
+            double temp = .0;
 
-            for( int k = 0; k < _number_of_tissues; ++k ){
-                if( denominator != 0 ){
-                    _atlas.SetValue(k, numerator[k] / denominator);
-                }else{
-                    _atlas.SetValue(k, 1/k);
+            if(bMRF){
+                double close = total;
+                for( int c = _conn_far_offsets[k]; c < _conn_far_offsets[k+1]; ++c ){
+                    close -= values[_conn_far_labels[c]];
                 }
+                temp = values[k] * close;
+            }else{
+                temp = values[k];
             }
+            numerator[k] += temp;
+            denominator += numerator[k];
+        }
 
-            if (denominator <= 0) {
-                int x,y,z;
-                _input.IndexToVoxel(i, x, y, z);
-                std::cerr<<"Division by 0 while computing relaxed prior probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+        for( int k = 0; k < _number_of_tissues; ++k ){
+            if( denominator != 0 ){
+                if (sparse) filteredAtlas.Put(i, k, numerator[k] / denominator);
+                else _atlas.Put(i, k, numerator[k] / denominator);
+            }else{
+                if (sparse) filteredAtlas.Put(i, k, 1/k);
+                else _atlas.Put(i, k, 1/k);
             }
         }
-        pm++;
-        ptr++;
-        _output.Next();
-        _atlas.Next();
-        filteredAtlas.Next();
+
+        if (denominator <= 0) {
+            int x,y,z;
+            _input.IndexToVoxel(i, x, y, z);
+            std::cerr<<"Division by 0 while computing relaxed prior probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+        }
     }
+
+    if (sparse) {
+        const double epsilon = _atlas.GetEpsilon();
+        _atlas = filteredAtlas;
+        _atlas.MakeSparse(_mask, epsilon);
+        _output.MakeSparse(_mask, epsilon, &_atlas);
+        _mstep_sums_valid = false;
+    }
+    // the priors changed everywhere, the next MRF E-step updates all voxels
+    _mrf_changed.clear();
 }
 
 
@@ -297,14 +419,17 @@ int DrawEM::AddPartialVolumeClass(int classA, int classB, int huiclass)
     RealImage newimage = pvclass;
     _output.AddImage(newimage);
 
+    // posteriors outside of the mask stay 0, see CreateMask
     _atlas.First();
     _output.First();
+    pm = _mask.GetPointerToVoxels();
     for( int i = 0; i < _number_of_voxels; ++i )
     {
         for( int k = 0; k < _number_of_tissues; ++k)
         {
-            _output.SetValue(k, _atlas.GetValue(k));
+            _output.SetValue(k, (*pm == 1) ? _atlas.GetValue(k) : 0);
         }
+        pm++;
         _atlas.Next();
         _output.Next();
     }
@@ -378,6 +503,9 @@ int DrawEM::AddPartialVolumeClass(int classA, int classB, int huiclass)
     }
 
     _connectivity = newconnectivity;
+    compileConnectivity();
+    _mstep_sums_valid = false;
+    _mrf_changed.clear();
     int pv_position = _number_of_tissues - 1;
     //mine
     //int pv_position = _number_of_tissues;
@@ -412,254 +540,548 @@ int DrawEM::AddPartialVolumeClass(int classA, int classB, int huiclass)
 
 
 bool print=true;
-double DrawEM::getMRFenergy(int index, int tissue)
+void DrawEM::compileConnectivity()
 {
+    int i, j, n = 0;
+    if (_connectivity.Rows() == _connectivity.Cols()) n = _connectivity.Rows();
+
+    // non-zero connectivity(k,t) of each tissue t
+    _conn_offsets.resize(n+1);
+    _conn_labels.clear();
+    _conn_values.clear();
+    _conn_offsets[0] = 0;
+    for (j = 0; j < n; j++) {
+        for (i = 0; i < n; i++) {
+            const double conn = _connectivity.Get(i, j);
+            if (conn == 0) continue;
+            _conn_labels.push_back(i);
+            _conn_values.push_back(conn);
+        }
+        _conn_offsets[j+1] = static_cast<int>(_conn_labels.size());
+    }
 
-
-    if( _connectivity.Rows() == 1 )
-    {
-        return 1.0;
+    // distant structures (connectivity(k,j) > 1) of each structure k
+    _conn_far_offsets.resize(n+1);
+    _conn_far_labels.clear();
+    _conn_far_offsets[0] = 0;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            if (_connectivity.Get(i, j) > 1) _conn_far_labels.push_back(j);
+        }
+        _conn_far_offsets[i+1] = static_cast<int>(_conn_far_labels.size());
     }
+}
+
+void DrawEM::initMRFKernel()
+{
     double dx,dy,dz;
     _input.GetPixelSize(&dx,&dy,&dz);
+    const int X = _input.GetX(), Y = _input.GetY();
+
+    _mrf_offsets.clear();
+    _mrf_weights.clear();
+    _mrf_shifts.clear();
+    _mrf_diag_offsets.clear();
+    _mrf_diag_weights.clear();
+    _mrf_diag_shifts.clear();
+    for (int cz = -1; cz <= 1; cz++)
+    for (int cy = -1; cy <= 1; cy++)
+    for (int cx = -1; cx <= 1; cx++) {
+        const int d = abs(cx) + abs(cy) + abs(cz);
+        if (d == 0) continue;
+        // 26 neighbours of getMRFenergy_diag, independent of bignn
+        _mrf_diag_offsets.push_back(cx + X * (cy + Y * cz));
+        _mrf_diag_weights.push_back(1.0/sqrt(pow(dx*cx,2)+pow(dy*cy,2)+pow(dz*cz,2)));
+        _mrf_diag_shifts.push_back(cx);
+        _mrf_diag_shifts.push_back(cy);
+        _mrf_diag_shifts.push_back(cz);
+        if (!bignn && d > 1) continue;
+        // 6 neighbours are weighted by the inverse spacing, 26 neighbours by the inverse distance
+        double weight;
+        if (bignn) weight = 1.0/sqrt(pow(dx*cx,2)+pow(dy*cy,2)+pow(dz*cz,2));
+        else weight = 1.0/(cx ? dx : (cy ? dy : dz));
+        _mrf_offsets.push_back(cx + X * (cy + Y * cz));
+        _mrf_weights.push_back(weight);
+        _mrf_shifts.push_back(cx);
+        _mrf_shifts.push_back(cy);
+        _mrf_shifts.push_back(cz);
+    }
+}
 
-    double sx, sy,sz;
-    sx = 1.0/dx;
-    sy = 1.0/dy;
-    sz = 1.0/dz;
-
-    double expo = -1.0* mrfweight;
+void DrawEM::addMRFNeighbour(int index, double weight, double *sums)
+{
+    HashProbabilisticAtlas *source = _mrf_source ? _mrf_source : &_output;
+    if (source->IsCompact()) {
+        const ProbabilityPixel *p = source->GetValues(index);
+        if (p == NULL) return;
+        const int *l = source->GetLabels(index);
+        const int n = source->GetNumberOfValues(index);
+        for (int j = 0; j < n; j++) sums[l ? l[j] : j] += weight * p[j];
+    } else {
+        for (int k = 0; k < _number_of_tissues; k++) sums[k] += weight * source->Get(index, k);
+    }
+}
 
-    double energy = .0;
-    int x,y,z;
-    _input.IndexToVoxel(index, x, y, z);
-    expo *= beta;
+void DrawEM::getMRFenergies(int index, int id, double *sums, double *energies)
+{
+    int k, t;
 
-    double weight = 0;
-    int lx = max(x-1,0);
-    int rx = min(x+1, _input.GetX()-1 );
-    int ly = max(y-1,0);
-    int ry = min(y+1, _input.GetY()-1 );
-    int lz = max(z-1,0);
-    int rz = min(z+1, _input.GetZ()-1 );
-
-    for( int k = 0; k < _number_of_tissues; k++)
+    if( _connectivity.Rows() == 1 || _connectivity.Rows() != _number_of_tissues )
     {
-        double temp = 0;
-        weight = 0;
-        double conn = _connectivity.Get(k, tissue);
-        weight=conn;
-        if( conn == 2 ) weight = 5;
-        else if (conn==0) continue;
-
-
-        temp += sx * (_output.GetValue( rx ,y,z,k) + _output.GetValue( lx,y,z,k) );
-        temp += sy * ( _output.GetValue(x,ry,z,k) + _output.GetValue(x,ly,z,k) );
-        temp += sz * ( _output.GetValue(x,y,rz,k) + _output.GetValue(x,y,lz,k) );
+        for (t = 0; t < _number_of_tissues; t++) energies[t] = 1.0;
+        return;
+    }
 
-        energy += temp * weight;
+    // weighted sum of the posteriors of the neighbours for each structure
+    for (k = 0; k < _number_of_tissues; k++) sums[k] = 0;
+    const int N = static_cast<int>(_mrf_offsets.size());
+    if (!bignn && id >= 0) {
+        // same order as the kernel, neighbours outside of the mask have zero posteriors
+        const int *neighbours = &_active_neighbours[6*id];
+        for (int n = 0; n < N; n++) {
+            if (neighbours[n] >= 0) addMRFNeighbour(_active[neighbours[n]], _mrf_weights[n], sums);
+        }
+    } else {
+        int x,y,z;
+        _input.IndexToVoxel(index, x, y, z);
+        const int X = _input.GetX(), Y = _input.GetY(), Z = _input.GetZ();
+        if (x > 0 && x < X-1 && y > 0 && y < Y-1 && z > 0 && z < Z-1) {
+            for (int n = 0; n < N; n++) addMRFNeighbour(index + _mrf_offsets[n], _mrf_weights[n], sums);
+        } else {
+            // 6 neighbours outside of the image are replaced by the voxel itself, 26 neighbours are skipped
+            for (int n = 0; n < N; n++) {
+                const int cx = x + _mrf_shifts[3*n], cy = y + _mrf_shifts[3*n+1], cz = z + _mrf_shifts[3*n+2];
+                const bool inside = (cx >= 0 && cx < X && cy >= 0 && cy < Y && cz >= 0 && cz < Z);
+                if (inside) addMRFNeighbour(index + _mrf_offsets[n], _mrf_weights[n], sums);
+                else if (!bignn) addMRFNeighbour(index, _mrf_weights[n], sums);
+            }
+        }
     }
 
-    expo *= energy;
-    return exp(expo);
+    // energies of all tissues from the non-zero connectivities
+    const double expo = bignn ? -0.5 * beta : -1.0 * mrfweight * beta;
+    for (t = 0; t < _number_of_tissues; t++) {
+        double energy = 0;
+        for (int c = _conn_offsets[t]; c < _conn_offsets[t+1]; c++) {
+            const double conn = _conn_values[c];
+            if (bignn) energy += conn * sums[_conn_labels[c]];
+            else energy += ((conn == 2) ? 5 : conn) * sums[_conn_labels[c]];
+        }
+        energies[t] = exp(expo * energy);
+    }
 }
 
-
-
-double wneighbors[3][3][3];
 double DrawEM::getMRFenergy_diag(int index, int tissue)
 {
-
-
-    if( _connectivity.Rows() == 1 )
+    if( _connectivity.Rows() == 1 || _connectivity.Rows() != _number_of_tissues )
     {
         return 1.0;
     }
-    double dx,dy,dz;
-    _input.GetPixelSize(&dx,&dy,&dz);
-
-
-
-    double expo = -1.0;
-
-    double energy = .0;
+    const HashProbabilisticAtlas *source = _mrf_source ? _mrf_source : &_output;
     int x,y,z;
     _input.IndexToVoxel(index, x, y, z);
-    expo *= beta;
-
-    double weight = 0;
-
-    int lx = max(x-1,0);
-    int rx = min(x+1, _input.GetX()-1 );
-    int ly = max(y-1,0);
-    int ry = min(y+1, _input.GetY()-1 );
-    int lz = max(z-1,0);
-    int rz = min(z+1, _input.GetZ()-1 );
-
-    double dist;
-    for(int cx=lx;cx<=rx;cx++){
-        for(int cy=ly;cy<=ry;cy++){
-            for(int cz=lz;cz<=rz;cz++){
-                if(cx==x && cy==y && cz==z) continue;
-                dist=1.0/sqrt(pow(dx*(cx-x),2)+pow(dy*(cy-y),2)+pow(dz*(cz-z),2) );
-                wneighbors[cx-x+1][cy-y+1][cz-z+1]=dist;
-            }
+    const int X = _input.GetX(), Y = _input.GetY(), Z = _input.GetZ();
+    const bool interior = (x > 0 && x < X-1 && y > 0 && y < Y-1 && z > 0 && z < Z-1);
+
+    // weighted posteriors of the neighbours with the non-zero connectivities of the tissue,
+    // neighbours outside of the image are skipped
+    double energy = 0;
+    const int N = static_cast<int>(_mrf_diag_offsets.size());
+    for (int n = 0; n < N; n++) {
+        if (!interior) {
+            const int cx = x + _mrf_diag_shifts[3*n], cy = y + _mrf_diag_shifts[3*n+1], cz = z + _mrf_diag_shifts[3*n+2];
+            if (cx < 0 || cx >= X || cy < 0 || cy >= Y || cz < 0 || cz >= Z) continue;
+        }
+        const int neighbour = index + _mrf_diag_offsets[n];
+        double sum = 0;
+        for (int c = _conn_offsets[tissue]; c < _conn_offsets[tissue+1]; c++) {
+            sum += _conn_values[c] * source->Get(neighbour, _conn_labels[c]);
         }
+        energy += _mrf_diag_weights[n] * sum;
     }
+    return exp(-0.5 * beta * energy);
+}
 
 
 
-    for( int k = 0; k < _number_of_tissues; k++)
-    {
-        double temp = 0;
-        weight = 0;
-        double conn = _connectivity.Get(k, tissue);
-
-        weight=conn;
-
-        for(int cx=lx;cx<=rx;cx++)
-            for(int cy=ly;cy<=ry;cy++)
-                for(int cz=lz;cz<=rz;cz++){
-                    if(cx==x && cy==y && cz==z) continue;
-                    temp += wneighbors[cx-x+1][cy-y+1][cz-z+1]*_output.GetValue( cx ,cy,cz,k);
-                }
 
-        energy += temp * weight;//    	G.Get(k,tissue);
-    }
+void DrawEM::EStepMRFVoxel(int id, const Gaussian *G, double *work, ProbabilityPixel *posterior)
+{
+    int k;
+    const int i = _active[id];
+    double *numerator   = work;
+    double *MRFenergies = work + _number_of_tissues;
+    double *neighbours  = work + 2 * _number_of_tissues;
+    double *energies    = work + 3 * _number_of_tissues;
+    double denominator=0, temp=0;
+    bool bMRF = _number_of_tissues == _connectivity.Rows();
 
-    expo *= energy;
-    expo /=2;
+    double x = _input.GetPointerToVoxels()[i];
+    const double *g = GetCachedLikelihoods(id);
+    double denominatorMRF = .0;
 
-    return exp(expo);
-}
+    if(beta!=0) getMRFenergies(i, id, neighbours, energies);
 
+    for (k = 0; k < _number_of_tissues; k++) {
+        double mrfenergy=1;
 
+        if(beta!=0) mrfenergy*=energies[k];
 
+        if(intermrf && betainter!=0) mrfenergy*=getMRFInterEnergy(i,k);
+        MRFenergies[k] = _atlas.Get(i, k) * mrfenergy;
+        denominatorMRF += MRFenergies[k];
+    }
 
-void DrawEM::EStepMRF()
-{
-    std::cout << "E-step with MRF" <<std::endl;
+    for (k = 0; k < _number_of_tissues; k++) {
+        temp = g ? g[k] : G[k].Evaluate(x);
 
-    IntegerImage segmentation;
+        // MRF matrix fits number of tissues?
+        if( bMRF )
+        {
+            //different step of MRF!!
+            temp = temp * MRFenergies[k] / denominatorMRF;
+        }
+        else
+        {
+            temp = temp * _atlas.Get(i, k);
+        }
 
-    int i, k;
-    double x;
-    Array<Gaussian> G(_number_of_tissues);
-    for (k = 0; k < _number_of_tissues; k++) {
-        G[k].Initialise( _mi[k], _sigma[k]);
+        numerator[k] = temp;
+        denominator += temp;
     }
 
-    RealPixel *pptr;
-    if(_postpen) pptr= _postpenalty.GetPointerToVoxels();
-
-    _atlas.First();
-    _output.First();
-    RealPixel *ptr = _input.GetPointerToVoxels();
-    BytePixel *pm = _mask.GetPointerToVoxels();
-    int per = 0;
-    Array<double> numerator(_number_of_tissues);
-    double denominator=0, temp=0;
-    bool bMRF = _number_of_tissues == _connectivity.Rows();
+    //model averaging
+    if (_postpen && denominator != 0) {
+        const RealPixel pp = _postpenalty.GetPointerToVoxels()[i];
+        double olddenom=denominator;
+        denominator=0;
+        for (k = 0; k < _number_of_tissues; k++) {
+            double value = numerator[k]/olddenom;
+            double priorvalue=_atlas.Get(i, k);
+            value=(1-pp)*value +pp *  priorvalue;
+            numerator[k] = value;
+            denominator += value;
+        }
+    }
 
+    for (k = 0; k < _number_of_tissues; k++) {
+        if (denominator > 0) {
+            double value = numerator[k]/denominator;
+            if ((value < 0) || (value > 1)) {
+                int x,y,z;
+                _input.IndexToVoxel(i, x, y, z);
+                std::cerr << "Probability value = " << value <<" @ Estep-mrf at voxel "<< x<<" "<<y<<" "<<z<< ", structure " << k << std::endl;
+                //exit(1);
+                if (value < 0)value=0;
+                if (value > 1)value=1;
+            }
+            posterior[k] = value;
 
-    for (i=0; i< _number_of_voxels; i++) {
-        if (i*10.0/_number_of_voxels > per) {
-            per++;
-            std::cout<<per<<"0%...";
+        } else {
+            posterior[k] = _atlas.Get(i, k);
         }
-        denominator = 0;
-        temp = 0;
-
-        if (*pm == 1) {
+    }
 
+    if (denominator <= 0) {
+        int x,y,z;
+        _input.IndexToVoxel(i, x, y, z);
+        std::cerr<<"Division by 0 while computing probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+    }
+}
 
-            x = *ptr;
-            Array<double> MRFenergies(_number_of_tissues);
-            double denominatorMRF = .0;
+int DrawEM::getMRFColour(int index, int colours) const
+{
+    if (colours == 1) return 0;
+    int x,y,z;
+    _input.IndexToVoxel(index, x, y, z);
+    if (colours == 2) return (x + y + z) & 1;
+    return (x & 1) | ((y & 1) << 1) | ((z & 1) << 2);
+}
 
-            for (k = 0; k < _number_of_tissues; k++) {
-                double mrfenergy=1;
+int DrawEM::selectMRFVoxels()
+{
+    const int N = static_cast<int>(_active.size());
+    const bool full = static_cast<int>(_mrf_changed.size()) != N
+                   || (_mrf_full_sweep > 0 && _mrf_sweep % _mrf_full_sweep == 0);
+    _mrf_sweep++;
+    if (full) {
+        _mrf_changed.assign(N, 1);
+        _mrf_selected.assign(N, 1);
+        return N;
+    }
 
-                if(beta!=0){
-                    if(bignn)mrfenergy*=getMRFenergy_diag(i,k);
-                    else mrfenergy*=getMRFenergy(i,k);
+    // dilate the changed voxels by the MRF neighbourhood (the neighbours read by getMRFenergies)
+    _mrf_selected = _mrf_changed;
+    if (!bignn) {
+        for (int a = 0; a < N; a++) {
+            if (_mrf_changed[a]) continue;
+            const int *nb = &_active_neighbours[6 * static_cast<size_t>(a)];
+            for (int n = 0; n < 6; n++) {
+                if (nb[n] >= 0 && _mrf_changed[nb[n]]) {
+                    _mrf_selected[a] = 1;
+                    break;
+                }
+            }
+        }
+    } else {
+        // the 26 neighbours are not linked, the changed voxels are marked in the image
+        Array<unsigned char> changed(_input.GetNumberOfVoxels(), 0);
+        for (int a = 0; a < N; a++) changed[_active[a]] = _mrf_changed[a];
+        const int X = _input.GetX(), Y = _input.GetY(), Z = _input.GetZ();
+        const int K = static_cast<int>(_mrf_offsets.size());
+        for (int a = 0; a < N; a++) {
+            if (_mrf_changed[a]) continue;
+            const int i = _active[a];
+            int x,y,z;
+            _input.IndexToVoxel(i, x, y, z);
+            const bool interior = (x > 0 && x < X-1 && y > 0 && y < Y-1 && z > 0 && z < Z-1);
+            for (int n = 0; n < K; n++) {
+                if (!interior) {
+                    const int cx = x + _mrf_shifts[3*n], cy = y + _mrf_shifts[3*n+1], cz = z + _mrf_shifts[3*n+2];
+                    if (cx < 0 || cx >= X || cy < 0 || cy >= Y || cz < 0 || cz >= Z) continue;
+                }
+                if (changed[i + _mrf_offsets[n]]) {
+                    _mrf_selected[a] = 1;
+                    break;
                 }
-
-                if(intermrf && betainter!=0) mrfenergy*=getMRFInterEnergy(i,k);
-                MRFenergies[k] = _atlas.GetValue(k) * mrfenergy;
-                denominatorMRF += MRFenergies[k];
             }
+        }
+    }
 
+    int count = 0;
+    for (int a = 0; a < N; a++) count += _mrf_selected[a];
+    return count;
+}
 
+void DrawEM::setMRFChanged(int id, const ProbabilityPixel *posterior)
+{
+    const int i = _active[id];
+    // the posteriors before this E-step
+    const HashProbabilisticAtlas *previous = _mrf_source ? _mrf_source : &_output;
+    unsigned char changed = 0;
+    for (int k = 0; k < _number_of_tissues && !changed; k++) {
+        if (fabs(static_cast<double>(posterior[k]) - previous->Get(i, k)) > _mrf_tolerance) changed = 1;
+    }
+    _mrf_changed[id] = changed;
+}
 
+/// Computes the MRF posteriors of the active voxels of one colour within a block. Row-wise
+/// posteriors are updated in place, hashed posteriors are written to a buffer.
+struct DrawEM::EStepMRFBody
+{
+    DrawEM                 *_em;
+    const Gaussian         *_G;
+    int                     _colour;
+    int                     _colours;
+    int                     _offset;
+    ProbabilityPixel       *_posteriors;
+    const unsigned char    *_selected;
+
+    void operator ()(const blocked_range<int> &re) const
+    {
+        const int K = _em->_number_of_tissues;
+        Array<double> work(4 * K);
+        Array<ProbabilityPixel> values(K);
+        for (int a = re.begin(); a != re.end(); ++a) {
+            if (_selected && !_selected[a]) continue;
+            const int i = _em->_active[a];
+            if (_em->getMRFColour(i, _colours) != _colour) continue;
+            if (_posteriors) {
+                ProbabilityPixel *posterior = _posteriors + static_cast<size_t>(a - _offset) * K;
+                _em->EStepMRFVoxel(a, _G, work.data(), posterior);
+                if (_selected) _em->setMRFChanged(a, posterior);
+            } else {
+                _em->EStepMRFVoxel(a, _G, work.data(), values.data());
+                if (_selected) _em->setMRFChanged(a, values.data());
+                for (int k = 0; k < K; k++) _em->_output.Put(i, k, values[k]);
+            }
+        }
+    }
+};
 
-            for (k = 0; k < _number_of_tissues; k++) {
-                temp = G[k].Evaluate(x);
+/// Writes the buffered posteriors of one colour within a block to the hashed maps, one map per task
+struct DrawEM::WriteMRFBody
+{
+    DrawEM                 *_em;
+    int                     _colour;
+    int                     _colours;
+    int                     _begin;
+    int                     _end;
+    const ProbabilityPixel *_posteriors;
+    const unsigned char    *_selected;
+
+    void operator ()(const blocked_range<int> &re) const
+    {
+        const int K = _em->_number_of_tissues;
+        for (int k = re.begin(); k != re.end(); ++k) {
+            for (int a = _begin; a < _end; ++a) {
+                if (_selected && !_selected[a]) continue;
+                const int i = _em->_active[a];
+                if (_em->getMRFColour(i, _colours) != _colour) continue;
+                _em->_output.Put(i, k, _posteriors[static_cast<size_t>(a - _begin) * K + k]);
+            }
+        }
+    }
+};
 
-                // MRF matrix fits number of tissues?
-                if( bMRF )
-                {
-                    //different step of MRF!!
-                    temp = temp * MRFenergies[k] / denominatorMRF;
-                }
-                else
-                {
-                    temp = temp * _atlas.GetValue(k);
-                }
+/// Copies the posteriors of the active voxels that the Jacobi MRF E-step does not update from
+/// the previous posteriors, over the active voxels (rows) or one map per task (hashed maps)
+struct DrawEM::CopyMRFBody
+{
+    DrawEM                 *_em;
+    const unsigned char    *_selected;
 
-                numerator[k] = temp;
-                denominator += temp;
+    void operator ()(const blocked_range<int> &re) const
+    {
+        HashProbabilisticAtlas &output = _em->_output;
+        HashProbabilisticAtlas &previous = _em->_mrf_previous;
+        if (output.IsCompact()) {
+            for (int a = re.begin(); a != re.end(); ++a) {
+                if (_selected[a]) continue;
+                const int i = _em->_active[a];
+                const ProbabilityPixel *values = previous.GetValues(i);
+                if (values == NULL) continue;
+                std::copy(values, values + previous.GetNumberOfValues(i), output.GetValues(i));
             }
-
-            //model averaging
-            if (_postpen && denominator != 0) {
-                double olddenom=denominator;
-                denominator=0;
-                for (k = 0; k < _number_of_tissues; k++) {
-                    double value = numerator[k]/olddenom;
-                    double priorvalue=_atlas.GetValue(k);
-                    value=(1-*pptr)*value +*pptr *  priorvalue;
-                    numerator[k] = value;
-                    denominator += value;
+        } else {
+            const int N = static_cast<int>(_em->_active.size());
+            for (int k = re.begin(); k != re.end(); ++k) {
+                for (int a = 0; a < N; ++a) {
+                    if (_selected[a]) continue;
+                    const int i = _em->_active[a];
+                    output.Put(i, k, previous.Get(i, k));
                 }
             }
+        }
+    }
+};
 
+void DrawEM::EStepMRF()
+{
+    std::cout << "E-step with MRF" <<std::endl;
+
+    int a, k;
+    Array<Gaussian> G(_number_of_tissues);
+    for (k = 0; k < _number_of_tissues; k++) {
+        G[k].Initialise( _mi[k], _sigma[k]);
+    }
 
+    initMRFKernel();
+    UpdateLikelihoods();
+    const int N = static_cast<int>(_active.size());
 
-            for (k = 0; k < _number_of_tissues; k++) {
-                if (denominator > 0) {
-                    double value = numerator[k]/denominator;
-                    if ((value < 0) || (value > 1)) {
-                        int x,y,z;
-                        _input.IndexToVoxel(i, x, y, z);
-                        std::cerr << "Probability value = " << value <<" @ Estep-mrf at voxel "<< x<<" "<<y<<" "<<z<< ", structure " << k << std::endl;
-                        //exit(1);
-                        if (value < 0)value=0;
-                        if (value > 1)value=1;
-                    }
-                    _output.SetValue(k, value);
+    // active set, only the voxels whose posteriors or neighbours changed are updated
+    const unsigned char *selected = NULL;
+    if (_mrf_tolerance > 0) {
+        const int updated = selectMRFVoxels();
+        selected = _mrf_selected.data();
+        std::cout << "Active set: updating " << updated << " of " << N << " voxels" << std::endl;
+    }
 
-                } else {
-                    _output.SetValue(k,_atlas.GetValue(k));
-                }
+    // M-step sums of the row-wise posteriors of each block once the block is final
+    const bool hashed = !_output.IsCompact();
+    const bool fused = !hashed && BeginMStepSums();
+
+    if (_mrf_update == MRFSequential) {
+        // in place in scan order, later voxels see the updated neighbours
+        int per = 0;
+        Array<double> work(4 * _number_of_tissues);
+        Array<ProbabilityPixel> posterior(_number_of_tissues);
+        for (a=0; a< N; a++) {
+            if (a*10.0/N > per) {
+                per++;
+                std::cout<<per<<"0%...";
             }
+            if (!selected || selected[a]) {
+                EStepMRFVoxel(a, G.data(), work.data(), posterior.data());
+                if (selected) setMRFChanged(a, posterior.data());
+                for (k = 0; k < _number_of_tissues; k++) _output.Put(_active[a], k, posterior[k]);
+            }
+            if (fused && ((a+1) % MStepBlockSize == 0 || a == N-1)) AddMStepBlockSums(a / MStepBlockSize);
+        }
+        if (fused) EndMStepSums();
+        printMRFChanged();
+        return;
+    }
 
-            if (denominator <= 0) {
-                int x,y,z;
-                _input.IndexToVoxel(i, x, y, z);
-                std::cerr<<"Division by 0 while computing probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+    // Jacobi reads the neighbours from the previous posteriors, red/black updates
+    // each colour at once, voxels of the same colour are not neighbours
+    int colours = 1;
+    if (_mrf_update == MRFJacobi) {
+        // the second buffer is copied once, or again when the storage of the posteriors changed
+        if (_mrf_previous.GetNumberOfMaps() != _output.GetNumberOfMaps() ||
+            _mrf_previous.IsCompact() != _output.IsCompact() || _mrf_previous.IsSparse() != _output.IsSparse()) {
+            _mrf_previous = _output;
+        }
+        _output.Swap(_mrf_previous);
+        _mrf_source = &_mrf_previous;
+        if (selected) {
+            // the voxels outside of the active set keep their posteriors
+            CopyMRFBody copy;
+            copy._em = this;
+            copy._selected = selected;
+            parallel_for(blocked_range<int>(0, hashed ? _number_of_tissues : N), copy);
+        }
+    } else {
+        colours = bignn ? 8 : 2;
+    }
+
+    EStepMRFBody body;
+    body._em = this;
+    body._G = G.data();
+    body._colours = colours;
+    body._offset = 0;
+    body._posteriors = NULL;
+    body._selected = selected;
+
+    const int block = hashed ? min(N, max(1, (1 << 22) / _number_of_tissues)) : N;
+    Array<ProbabilityPixel> posteriors;
+    if (hashed) posteriors.resize(static_cast<size_t>(block) * _number_of_tissues);
+
+    WriteMRFBody write;
+    write._em = this;
+    write._colours = colours;
+    write._posteriors = posteriors.data();
+    write._selected = selected;
+
+    for (int c = 0; c < colours; c++) {
+        body._colour = write._colour = c;
+        for (int begin = 0; begin < N; begin += block) {
+            const int end = min(begin + block, N);
+            if (hashed) {
+                body._offset = begin;
+                body._posteriors = posteriors.data();
             }
-        } else {
-            for (k = 0; k < _number_of_tissues ; k++) {
-                _output.SetValue(k, 0);
+            if (fused && c == colours-1) {
+                // the last colour completes the blocks
+                FusedEStepBody<EStepMRFBody> fbody;
+                fbody._em = this;
+                fbody._body = &body;
+                fbody._posteriors = NULL;
+                fbody._offset = 0;
+                parallel_for(blocked_range<int>(0, (N + MStepBlockSize - 1) / MStepBlockSize), fbody);
+            } else {
+                parallel_for(blocked_range<int>(begin, end), body);
+            }
+            if (hashed) {
+                write._begin = begin;
+                write._end = end;
+                parallel_for(blocked_range<int>(0, _number_of_tissues), write);
             }
         }
-        if(_postpen)pptr++;
-        ptr++;
-        pm++;
-        _atlas.Next();
-        _output.Next();
     }
+
+    _mrf_source = NULL;
+    if (fused) EndMStepSums();
+    printMRFChanged();
+}
+
+void DrawEM::printMRFChanged() const
+{
+    if (_mrf_tolerance <= 0) return;
+    int count = 0;
+    for (size_t a = 0; a < _mrf_changed.size(); a++) count += _mrf_changed[a];
+    std::cout << std::endl << "Active set: " << count << " voxels changed by more than " << _mrf_tolerance << std::endl;
 }
 
 
@@ -692,11 +1114,45 @@ double DrawEM::Iterate(int i)
     std::cout << std::endl << std::endl << "After M STEP " << std::endl << std::endl;
     Print();
     this->WStep();
+
+    // the log likelihood of the exactly evaluated likelihoods in the bias correction pass
+    if (_fused_iteration && !_cache_likelihoods && !_likelihood_table) {
+        const double f = bStepLogLikelihood();
+        std::cout << std::endl << std::endl << "After B STEP " << std::endl << std::endl;
+        Print();
+        std::cout<< "Log likelihood: ";
+        return Accelerate(UpdateLogLikelihood(f), false);
+    }
+
     this->BStep();
 
     std::cout << std::endl << std::endl << "After B STEP " << std::endl << std::endl;
     Print();
-    return LogLikelihood();
+    // every iteration fits the bias field
+    return Accelerate(LogLikelihood(), false);
+}
+
+double DrawEM::IterateSegmentation(bool mrf, bool hui, bool bias, bool extrapolate)
+{
+    // the weights are computed from the posteriors of the E-step unless the Hui correction changes them
+    _fused_wstep = _fused_iteration && bias && !hui;
+    _fused_wstep_done = false;
+    if (mrf) this->EStepMRF();
+    else this->EStep();
+    _fused_wstep = false;
+
+    if (hui) this->huiPVCorrection();
+
+    if (bias) {
+        if (!_fused_wstep_done) this->WStep();
+        // the M-step reads the corrected input
+        if (_fused_iteration && _output.IsCompact()) bStepMStepSums();
+        else this->BStep();
+    }
+    this->MStep();
+
+    Print();
+    return Accelerate(LogLikelihood(), extrapolate);
 }
 
 void DrawEM::SetBiasField(BiasField *biasfield)
@@ -734,6 +1190,291 @@ void DrawEM::GetBiasField(RealImage &image)
     }
 }
 
+// Writes the non-zero values of each map at the active voxels as (active id, value) pairs,
+// the values in double precision so that a resumed run continues exactly
+static void WriteCheckpointMaps(Cofstream &to, const HashProbabilisticAtlas &atlas, const Array<int> &active)
+{
+    const int N = static_cast<int>(active.size());
+    Array<int> ids;
+    Array<double> values;
+    for (int k = 0; k < atlas.GetNumberOfMaps(); k++) {
+        ids.clear();
+        values.clear();
+        for (int a = 0; a < N; a++) {
+            const RealPixel value = atlas.Get(active[a], k);
+            if (value == 0) continue;
+            ids.push_back(a);
+            values.push_back(value);
+        }
+        int n = static_cast<int>(ids.size());
+        to.WriteAsInt(&n, 1);
+        if (n > 0) {
+            to.WriteAsInt(ids.data(), n);
+            to.WriteAsDouble(values.data(), n);
+        }
+    }
+}
+
+// Reads the K maps written by WriteCheckpointMaps. Hashed maps are overwritten at the active
+// voxels, compact maps are read into a new atlas of hashed images (the structures kept per
+// voxel may differ) which is compacted by the caller.
+static void ReadCheckpointMaps(Cifstream &from, int K, HashProbabilisticAtlas &atlas, HashProbabilisticAtlas &hashed,
+                               const ImageAttributes &attr, const Array<int> &active)
+{
+    const int N = static_cast<int>(active.size());
+    Array<int> ids;
+    Array<double> values;
+    for (int k = 0; k < K; k++) {
+        int n;
+        from.ReadAsInt(&n, 1);
+        ids.resize(n);
+        values.resize(n);
+        if (n > 0) {
+            from.ReadAsInt(ids.data(), n);
+            from.ReadAsDouble(values.data(), n);
+        }
+        for (int j = 0; j < n; j++) {
+            if (ids[j] < 0 || ids[j] >= N) {
+                std::cerr << "DrawEM::ReadCheckpoint: Voxel out of range" << std::endl;
+                exit(1);
+            }
+        }
+        if (atlas.IsCompact()) {
+            HashRealImage image(attr);
+            for (int j = 0; j < n; j++) image.Put(active[ids[j]], values[j]);
+            if (atlas.HasBackground() && k == K-1) hashed.AddBackground(image);
+            else hashed.AddImage(image);
+        } else {
+            for (int a = 0; a < N; a++) atlas.Put(active[a], k, 0);
+            for (int j = 0; j < n; j++) atlas.Put(active[ids[j]], k, values[j]);
+        }
+    }
+}
+
+void DrawEM::WriteCheckpoint(const char *filename, const Array<int> &state)
+{
+    int i, j, n;
+
+    // written to a temporary file first, an interrupted write keeps the previous checkpoint
+    string tmpname = string(filename) + ".tmp";
+    Cofstream to;
+    to.Open(tmpname.c_str());
+
+    unsigned int magic_no = DRAWEM_CHECKPOINT_MAGIC;
+    to.WriteAsUInt(&magic_no, 1, 0);
+    unsigned int version = DRAWEM_CHECKPOINT_VERSION;
+    to.WriteAsUInt(&version, 1);
+
+    // state of the caller
+    n = static_cast<int>(state.size());
+    to.WriteAsInt(&n, 1);
+    if (n > 0) to.WriteAsInt(state.data(), n);
+
+    // image and mask
+    to.WriteAsInt(&_number_of_voxels, 1);
+    n = static_cast<int>(_active.size());
+    to.WriteAsInt(&n, 1);
+
+    // PV classes (position and index, then the classes A and B in the order they were added)
+    // and their fractional content
+    n = static_cast<int>(pv_connections.size());
+    to.WriteAsInt(&n, 1);
+    map<int,int>::const_iterator it;
+    for (it = pv_classes.begin(); it != pv_classes.end(); ++it) {
+        int pv[2] = { it->first, it->second };
+        to.WriteAsInt(pv, 2);
+    }
+    for (i = 0; i < n; i++) {
+        int pv[2] = { pv_connections[i].first, pv_connections[i].second };
+        to.WriteAsInt(pv, 2);
+    }
+    if (n > 0) to.WriteAsDouble(pv_fc.data(), n);
+
+    // Gaussian parameters and log likelihood
+    to.WriteAsInt(&_number_of_tissues, 1);
+    to.WriteAsDouble(_mi.data(), _number_of_tissues);
+    to.WriteAsDouble(_sigma.data(), _number_of_tissues);
+    n = static_cast<int>(_c.size());
+    to.WriteAsInt(&n, 1);
+    if (n > 0) to.WriteAsDouble(_c.data(), n);
+    to.WriteAsDouble(&_f, 1);
+    n = static_cast<int>(tissuelabels.size());
+    to.WriteAsInt(&n, 1);
+    if (n > 0) to.WriteAsInt(tissuelabels.data(), n);
+
+    // connectivity
+    int rows = _connectivity.Rows(), cols = _connectivity.Cols();
+    to.WriteAsInt(&rows, 1);
+    to.WriteAsInt(&cols, 1);
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++) {
+            double value = _connectivity.Get(i, j);
+            to.WriteAsDouble(&value, 1);
+        }
+    }
+
+    // bias field
+    n = _biasfield ? _biasfield->NumberOfDOFs() : 0;
+    to.WriteAsInt(&n, 1);
+    for (i = 0; i < n; i++) {
+        double value = _biasfield->Get(i);
+        to.WriteAsDouble(&value, 1);
+    }
+
+    // priors and posteriors
+    WriteCheckpointMaps(to, _atlas, _active);
+    WriteCheckpointMaps(to, _output, _active);
+
+    to.Close();
+    if (rename(tmpname.c_str(), filename) != 0) {
+        std::cerr << "DrawEM::WriteCheckpoint: Cannot rename " << tmpname << " to " << filename << std::endl;
+        exit(1);
+    }
+}
+
+// Opens a checkpoint file and reads its header
+static void OpenCheckpoint(Cifstream &from, const char *filename, Array<int> &state)
+{
+    unsigned int magic_no, version;
+    from.Open(filename);
+    from.ReadAsUInt(&magic_no, 1, 0);
+    from.ReadAsUInt(&version, 1);
+    if (magic_no != DRAWEM_CHECKPOINT_MAGIC || version != DRAWEM_CHECKPOINT_VERSION) {
+        std::cerr << "DrawEM::ReadCheckpoint: File format not recognized: " << filename << std::endl;
+        exit(1);
+    }
+    int n;
+    from.ReadAsInt(&n, 1);
+    state.resize(n);
+    if (n > 0) from.ReadAsInt(state.data(), n);
+}
+
+void DrawEM::ReadCheckpointState(const char *filename, Array<int> &state)
+{
+    Cifstream from;
+    OpenCheckpoint(from, filename, state);
+    from.Close();
+}
+
+void DrawEM::ReadCheckpoint(const char *filename)
+{
+    int i, j, n;
+    Array<int> state;
+    Cifstream from;
+    OpenCheckpoint(from, filename, state);
+
+    int voxels, active;
+    from.ReadAsInt(&voxels, 1);
+    from.ReadAsInt(&active, 1);
+    if (voxels != _number_of_voxels || active != static_cast<int>(_active.size())) {
+        std::cerr << "DrawEM::ReadCheckpoint: Checkpoint does not match the image and mask" << std::endl;
+        exit(1);
+    }
+
+    // the PV classes are restored as stored, their maps are appended below
+    int npv;
+    from.ReadAsInt(&npv, 1);
+    if (!pv_connections.empty() && npv > 0) {
+        std::cerr << "DrawEM::ReadCheckpoint: PV classes were already added" << std::endl;
+        exit(1);
+    }
+    Array<int> positions(2 * npv), connections(2 * npv);
+    vector<double> fc(npv);
+    if (npv > 0) {
+        from.ReadAsInt(positions.data(), 2 * npv);
+        from.ReadAsInt(connections.data(), 2 * npv);
+        from.ReadAsDouble(fc.data(), npv);
+    }
+
+    int K;
+    from.ReadAsInt(&K, 1);
+    if (K != _number_of_tissues + npv) {
+        std::cerr << "DrawEM::ReadCheckpoint: Checkpoint has " << K << " structures, expected " << _number_of_tissues + npv << std::endl;
+        exit(1);
+    }
+    if (npv > 0) {
+        for (i = 0; i < npv; i++) {
+            pv_classes.insert(make_pair(positions[2*i], positions[2*i+1]));
+            pv_connections.push_back(make_pair(connections[2*i], connections[2*i+1]));
+        }
+        pv_fc = fc;
+        if (!_atlas.IsCompact()) {
+            // empty maps in the order of AddPartialVolumeClass, overwritten below
+            HashRealImage empty(_input.Attributes());
+            for (i = 0; i < npv; i++) {
+                _atlas.AddImage(empty);
+                _output.AddImage(empty);
+            }
+        }
+        _number_of_tissues = K;
+        _mi.resize(K);
+        _sigma.resize(K);
+    }
+    from.ReadAsDouble(_mi.data(), K);
+    from.ReadAsDouble(_sigma.data(), K);
+    from.ReadAsInt(&n, 1);
+    _c.resize(n);
+    if (n > 0) from.ReadAsDouble(_c.data(), n);
+    from.ReadAsDouble(&_f, 1);
+    from.ReadAsInt(&n, 1);
+    tissuelabels.resize(n);
+    if (n > 0) from.ReadAsInt(tissuelabels.data(), n);
+
+    int rows, cols;
+    from.ReadAsInt(&rows, 1);
+    from.ReadAsInt(&cols, 1);
+    Matrix connectivity(rows, cols);
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++) {
+            double value;
+            from.ReadAsDouble(&value, 1);
+            connectivity.Put(i, j, value);
+        }
+    }
+    _connectivity = connectivity;
+    compileConnectivity();
+
+    from.ReadAsInt(&n, 1);
+    if (n != (_biasfield ? _biasfield->NumberOfDOFs() : 0)) {
+        std::cerr << "DrawEM::ReadCheckpoint: Bias field has " << n << " coefficients in the checkpoint" << std::endl;
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        double value;
+        from.ReadAsDouble(&value, 1);
+        _biasfield->Put(i, value);
+    }
+
+    // compact maps are stored again as by CreateMask
+    HashProbabilisticAtlas atlas, output;
+    if (!_scratch_directory.empty()) {
+        atlas.SetScratchDirectory(_scratch_directory.c_str());
+        output.SetScratchDirectory(_scratch_directory.c_str());
+    }
+    ReadCheckpointMaps(from, K, _atlas, atlas, _input.Attributes(), _active);
+    ReadCheckpointMaps(from, K, _output, output, _input.Attributes(), _active);
+    from.Close();
+
+    if (_atlas.IsCompact()) {
+        if (_sparse_storage) {
+            atlas.MakeSparse(_mask, _sparse_epsilon);
+            output.MakeSparse(_mask, _sparse_epsilon, &atlas);
+        } else {
+            atlas.MakeDense(_mask);
+            output.MakeDense(_mask);
+        }
+        _atlas = atlas;
+        _output = output;
+    }
+
+    if (_biasfield) ApplyBiasField();
+    InvalidateLikelihoods();
+    _mstep_sums_valid = false;
+    _mrf_changed.clear();
+    // the rows of the posteriors may differ, the Jacobi buffer is copied again
+    _mrf_previous = HashProbabilisticAtlas();
+}
+
 bool DrawEM::isPVclass(int pvclass)
 {
     if( pv_classes.find(pvclass) != pv_classes.end() ) return true;
@@ -779,6 +1520,15 @@ void DrawEM::huiPVCorrection(bool changePosterior){
     double lambda=0.5;
 
     if(changePosterior)lambda=0;
+    _mstep_sums_valid = false;
+    _mrf_changed.clear();
+
+    // the probabilities are moved between structures of a tissue, sparse rows would drop them
+    if (_atlas.IsSparse()) {
+        std::cerr << "Warning: Hui PV correction needs all structures, storing atlas and posteriors densely from now on" << std::endl;
+        _atlas.MakeDense(_mask);
+        _output.MakeDense(_mask);
+    }
 
     std::cout<<"Hui PV correction "<<outlabel<<csflabel<<gmlabel<<wmlabel<<std::endl;
     IntegerImage segmentation, actualsegmentation;
@@ -1150,14 +1900,11 @@ double DrawEM::getMRFInterEnergy(int index, int tissue)
 
     double weight = 0;
 
-    for( int k = 0; k < _number_of_tissues; k++)
+    for( int c = _conn_offsets[tissue]; c < _conn_offsets[tissue+1]; c++)
     {
+        const int k = _conn_labels[c];
         double temp = 0;
-        weight = 0;
-        double conn = _connectivity.Get(k, tissue);
-
-        weight=conn;
-        if (conn==0) continue;
+        weight=_conn_values[c];
 
         temp += (_MRF_inter[k])->Get( x ,y,z);
         energy += temp * weight;
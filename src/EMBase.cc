@@ -20,9 +20,640 @@
 
 
 #include "mirtk/EMBase.h"
+#include "mirtk/Parallel.h"
+
+#include <algorithm>
 
 namespace mirtk {
 
+// =============================================================================
+// Auxiliary functors
+// =============================================================================
+
+namespace EMBaseUtils {
+
+/// Computes the posteriors of a range of active voxels. Hashed posteriors are written
+/// to a buffer of the active voxels from _offset, row-wise posteriors are updated in place.
+struct EStepBody
+{
+  const RealImage            *_input;
+  const int                  *_active;
+  const RealPixel            *_postpenalty;
+  HashProbabilisticAtlas     *_atlas;
+  HashProbabilisticAtlas     *_output;
+  const Gaussian             *_G;
+  const double               *_likelihoods;
+  const int                  *_likelihood_rows;
+  int                         _number_of_tissues;
+  ProbabilityPixel           *_posteriors;
+  int                         _offset;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    int j, k, n;
+    double x, temp, denominator;
+    const int *labels;
+    const ProbabilityPixel *prior;
+    ProbabilityPixel *posterior;
+    Array<ProbabilityPixel> priors(_number_of_tissues);
+    Array<double> numerator(_number_of_tissues);
+    const RealPixel *ptr = _input->GetPointerToVoxels();
+
+    for (int a = re.begin(); a != re.end(); ++a) {
+      const int i = _active[a];
+      if (_atlas->IsCompact()) {
+        prior = _atlas->GetValues(i);
+        if (prior == NULL) continue;
+        labels = _atlas->GetLabels(i);
+        n = _atlas->GetNumberOfValues(i);
+        posterior = _output->GetValues(i);
+      } else {
+        for (k = 0; k < _number_of_tissues; k++) priors[k] = _atlas->Get(i, k);
+        prior = priors.data();
+        labels = NULL;
+        n = _number_of_tissues;
+        posterior = _posteriors + static_cast<size_t>(a - _offset) * _number_of_tissues;
+      }
+
+      // the normalisation of the likelihoods cancels out
+      x = ptr[i];
+      const double *g = NULL;
+      if (_likelihoods) g = _likelihoods + static_cast<size_t>(_likelihood_rows[a]) * _number_of_tissues;
+      denominator = 0;
+      for (j = 0; j < n; j++) {
+        k = labels ? labels[j] : j;
+        temp = (g ? g[k] : _G[k].Evaluate(x)) * prior[j];
+        numerator[j] = temp;
+        denominator += temp;
+      }
+
+      //model averaging
+      if (_postpenalty && denominator != 0) {
+        double olddenom = denominator;
+        denominator = 0;
+        for (j = 0; j < n; j++) {
+          double value = numerator[j]/olddenom;
+          value = (1-_postpenalty[i])*value + _postpenalty[i] * prior[j];
+          numerator[j] = value;
+          denominator += value;
+        }
+      }
+
+      for (j = 0; j < n; j++) {
+        if (denominator != 0) {
+          double value = numerator[j]/denominator;
+          if ((value < 0) || (value > 1)) {
+            int x,y,z;
+            _input->IndexToVoxel(i, x, y, z);
+            std::cerr << "Probability value = " << value <<" @ Estep at voxel "<< x<<" "<<y<<" "<<z<< ", structure " << (labels ? labels[j] : j) << std::endl;
+            if (value < 0)value=0;
+            if (value > 1)value=1;
+          }
+          posterior[j] = value;
+        } else {
+          posterior[j] = prior[j];
+        }
+      }
+
+      if (denominator == 0) {
+        int x,y,z;
+        _input->IndexToVoxel(i, x, y, z);
+        std::cerr<<"Division by 0 while computing probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+      }
+    }
+  }
+};
+
+/// Computes the GMM posteriors of a range of voxels, see EStepBody
+struct EStepGMMBody
+{
+  const RealImage            *_input;
+  const int                  *_active;
+  HashProbabilisticAtlas     *_atlas;
+  HashProbabilisticAtlas     *_output;
+  const Gaussian             *_G;
+  const double               *_c;
+  const double               *_likelihoods;
+  const int                  *_likelihood_rows;
+  int                         _number_of_tissues;
+  ProbabilityPixel           *_posteriors;
+  int                         _offset;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    int k;
+    double x, temp, denominator;
+    Array<double> numerator(_number_of_tissues);
+    const RealPixel *ptr = _input->GetPointerToVoxels();
+
+    for (int a = re.begin(); a != re.end(); ++a) {
+      const int i = _active[a];
+      ProbabilityPixel *posterior = NULL;
+      if (!_output->IsCompact()) posterior = _posteriors + static_cast<size_t>(a - _offset) * _number_of_tissues;
+
+      x = ptr[i];
+      const double *g = NULL;
+      if (_likelihoods) g = _likelihoods + static_cast<size_t>(_likelihood_rows[a]) * _number_of_tissues;
+      denominator = 0;
+      for (k = 0; k < _number_of_tissues; k++) {
+        temp = g ? g[k] : _G[k].Evaluate(x);
+        if (_c) temp = temp * _c[k];
+        numerator[k] = temp;
+        denominator += temp;
+      }
+      for (k = 0; k < _number_of_tissues; k++) {
+        double value;
+        if (denominator != 0) {
+          value = numerator[k]/denominator;
+          if ((value < 0) || (value > 1)) {
+            int x,y,z;
+            _input->IndexToVoxel(i, x, y, z);
+            std::cerr << "Probability value = " << value <<" @ Estep gmm at voxel "<< x<<" "<<y<<" "<<z<< ", structure " << k << std::endl;
+            if (value < 0)value=0;
+            if (value > 1)value=1;
+          }
+        } else {
+          value = _atlas->Get(i, k);
+        }
+        // row-wise posteriors are updated in place, inactive structures are skipped
+        if (posterior) posterior[k] = value;
+        else _output->Put(i, k, value);
+      }
+
+      if (denominator <= 0) {
+        int x,y,z;
+        _input->IndexToVoxel(i, x, y, z);
+        std::cerr<<"Division by 0 while computing probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+      }
+    }
+  }
+};
+
+/// Writes buffered posteriors of a range of active voxels to the hashed maps, one map per task
+struct WritePosteriorsBody
+{
+  const int                  *_active;
+  HashProbabilisticAtlas     *_output;
+  const ProbabilityPixel     *_posteriors;
+  int                         _number_of_tissues;
+  int                         _begin;
+  int                         _end;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    for (int k = re.begin(); k != re.end(); ++k) {
+      const ProbabilityPixel *posterior = _posteriors + k;
+      for (int a = _begin; a < _end; ++a, posterior += _number_of_tissues) {
+        _output->Put(_active[a], k, *posterior);
+      }
+    }
+  }
+};
+
+/// Adds p*mi/sigma and p/sigma of the posteriors of a voxel to num and den, see WStepBody
+inline void AddWStepSums(const ProbabilityPixel *values, const int *labels, int n, const double *mi, const double *sigma, double &num, double &den)
+{
+  for (int j = 0; j < n; j++) {
+    const int k = labels ? labels[j] : j;
+    num += values[j]*mi[k]/sigma[k];
+    den += values[j]/sigma[k];
+  }
+}
+
+/// Computes the weights and intensity estimates of a range of active voxels
+struct WStepBody
+{
+  const int                  *_active;
+  HashProbabilisticAtlas     *_output;
+  const double               *_mi;
+  const double               *_sigma;
+  int                         _number_of_tissues;
+  RealPixel                  *_weights;
+  RealPixel                  *_estimate;
+  RealPixel                   _padding;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    int k;
+    double num, den;
+    for (int a = re.begin(); a != re.end(); ++a) {
+      const int i = _active[a];
+      num = 0;
+      den = 0;
+      if (_output->IsCompact()) {
+        AddWStepSums(_output->GetValues(i), _output->GetLabels(i), _output->GetNumberOfValues(i), _mi, _sigma, num, den);
+      } else {
+        for (k = 0; k < _number_of_tissues; k++) {
+          num += _output->Get(i, k)*_mi[k]/_sigma[k];
+          den += _output->Get(i, k)/_sigma[k];
+        }
+      }
+      if (den != 0) {
+        _weights[i] = den;
+        _estimate[i] = num/den;
+      } else {
+        _weights[i] = _padding;
+        _estimate[i] = _padding;
+      }
+    }
+  }
+};
+
+/// Returns the sum of the likelihoods weighted by the posteriors at voxel i with intensity x,
+/// g holds the likelihoods of all structures if cached
+inline double LikelihoodSum(HashProbabilisticAtlas *output, int i, double x, const Gaussian *G,
+                            const double *g, int number_of_tissues)
+{
+  int j, k;
+  double l, temp = 0;
+  if (output->IsCompact()) {
+    const ProbabilityPixel *p = output->GetValues(i);
+    const int *labels = output->GetLabels(i);
+    const int n = output->GetNumberOfValues(i);
+    for (j = 0; j < n; j++) {
+      k = labels ? labels[j] : j;
+      l = g ? g[k] : G[k].Evaluate(x);
+      if (l > 1) l = 1.0;
+      temp += l * p[j];
+    }
+  } else {
+    for (k = 0; k < number_of_tissues; k++) {
+      l = g ? g[k] : G[k].Evaluate(x);
+      if (l > 1) l = 1.0;
+      temp += l * output->Get(i, k);
+    }
+  }
+  return temp;
+}
+
+/// Sums the log likelihood over fixed blocks of active voxels, see SumLogLikelihood
+struct LogLikelihoodBody
+{
+  const RealPixel            *_input;
+  const int                  *_active;
+  HashProbabilisticAtlas     *_output;
+  const Gaussian             *_G;
+  const double               *_c;
+  const double               *_likelihoods;
+  const int                  *_likelihood_rows;
+  int                         _number_of_tissues;
+  int                         _number_of_voxels;
+  int                         _block_size;
+  double                     *_sums;
+
+  /// Returns the log likelihood of block b
+  double Block(int b) const
+  {
+    int k;
+    double temp, f = 0;
+    const int end = min(_number_of_voxels, (b + 1) * _block_size);
+    for (int a = b * _block_size; a < end; a++) {
+      const int i = _active[a];
+      const double *gv = NULL;
+      if (_likelihoods) gv = _likelihoods + static_cast<size_t>(_likelihood_rows[a]) * _number_of_tissues;
+      temp = 0;
+      if (_c) {
+        // Probability that current voxel is from tissue k with the mixing proportions
+        for (k = 0; k < _number_of_tissues; k++) temp += (gv ? gv[k] : _G[k].Evaluate(_input[i])) * _c[k];
+      } else {
+        temp = LikelihoodSum(_output, i, _input[i], _G, gv, _number_of_tissues);
+      }
+      if ((temp > 0) && (temp <= 1)) {
+        f += log(temp);
+      }
+    }
+    return f;
+  }
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    for (int b = re.begin(); b != re.end(); ++b) _sums[b] = Block(b);
+  }
+};
+
+/// Evaluates the likelihoods of all structures for a range of intensities
+struct LikelihoodCacheBody
+{
+  const double               *_values;
+  const Gaussian             *_G;
+  int                         _number_of_tissues;
+  double                     *_likelihoods;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    Gaussian::Evaluate(_G, _number_of_tissues, _values + re.begin(), re.end() - re.begin(),
+                       _likelihoods + static_cast<size_t>(re.begin()) * _number_of_tissues);
+  }
+};
+
+/// Adds p, p*(x-s_k), p*(x-s_k)^2 and 1 of the non-zero posteriors of a voxel to the sums of the structures
+inline void AddMStepSums(const ProbabilityPixel *values, const int *labels, int n, double x, const double *shift, double *sums)
+{
+  for (int j = 0; j < n; j++) {
+    if (values[j] == 0) continue;
+    const int k = labels ? labels[j] : j;
+    const double p = values[j];
+    const double d = x - shift[k];
+    double *s = sums + 4 * k;
+    s[0] += p;
+    s[1] += p * d;
+    s[2] += p * d * d;
+    s[3] += 1;
+  }
+}
+
+/// Adds up the sums of the blocks by a pairwise reduction in fixed order, the blocks are overwritten
+void ReduceMStepSums(Array<double> &blocks, int number_of_blocks, int n, Array<double> &sums)
+{
+  for (int step = 1; step < number_of_blocks; step *= 2) {
+    for (int b = 0; b + step < number_of_blocks; b += 2 * step) {
+      double *a = &blocks[static_cast<size_t>(b) * n];
+      const double *c = &blocks[static_cast<size_t>(b + step) * n];
+      for (int k = 0; k < n; k++) a[k] += c[k];
+    }
+  }
+  sums.resize(n);
+  for (int k = 0; k < n; k++) sums[k] = (number_of_blocks > 0) ? blocks[k] : 0;
+}
+
+/// Returns the log likelihood of the active voxels, summed in fixed blocks which are added in
+/// fixed order. The sum does not depend on the number of threads.
+double SumLogLikelihood(LogLikelihoodBody &body, int number_of_voxels)
+{
+  const int block_size = EMBase::MStepBlockSize;
+  const int number_of_blocks = max(1, (number_of_voxels + block_size - 1) / block_size);
+  Array<double> blocks(number_of_blocks, 0.), sum;
+  body._number_of_voxels = number_of_voxels;
+  body._block_size = block_size;
+  body._sums = blocks.data();
+  parallel_for(blocked_range<int>(0, number_of_blocks), body);
+  ReduceMStepSums(blocks, number_of_blocks, 1, sum);
+  return sum[0];
+}
+
+/// Sums p, p*(x-s_k) and p*(x-s_k)^2 of each structure over fixed blocks of active voxels.
+/// The block sums do not depend on the number of threads.
+struct MStepBlockBody
+{
+  const RealPixel            *_input;
+  const int                  *_active;
+  HashProbabilisticAtlas     *_output;
+  const double               *_shift;
+  int                         _number_of_voxels;
+  int                         _number_of_tissues;
+  int                         _block_size;
+  double                     *_sums;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    int i, k;
+    for (int b = re.begin(); b != re.end(); ++b) {
+      double *sums = _sums + static_cast<size_t>(b) * 4 * _number_of_tissues;
+      for (k = 0; k < 4 * _number_of_tissues; k++) sums[k] = 0;
+      const int end = min(_number_of_voxels, (b + 1) * _block_size);
+      for (int a = b * _block_size; a < end; a++) {
+        i = _active[a];
+        const ProbabilityPixel *values = _output->GetValues(i);
+        if (values == NULL) continue;
+        AddMStepSums(values, _output->GetLabels(i), _output->GetNumberOfValues(i), _input[i], _shift, sums);
+      }
+    }
+  }
+};
+
+/// Sums p, p*(x-s_k) and p*(x-s_k)^2 over the entries of the hashed maps, one map per task
+struct MStepMapBody
+{
+  const RealPixel            *_input;
+  const BytePixel            *_mask;
+  HashProbabilisticAtlas     *_output;
+  const double               *_shift;
+  double                     *_sums;
+
+  void operator ()(const blocked_range<int> &re) const
+  {
+    double x;
+    for (int k = re.begin(); k != re.end(); ++k) {
+      double *s = _sums + 4 * k;
+      s[0] = s[1] = s[2] = s[3] = 0;
+      const auto end = _output->End(k);
+      for (auto it = _output->Begin(k); it != end; ++it) {
+        if (_mask[it->first] == 1) {
+          x = _input[it->first] - _shift[k];
+          s[0] += it->second;
+          s[1] += it->second * x;
+          s[2] += it->second * x * x;
+          s[3] += 1;
+        }
+      }
+    }
+  }
+};
+
+/// Computes for each structure k the sums over the masked voxels of p, p*(x-s_k),
+/// p*(x-s_k)^2 and the number of voxels with p != 0, stored at sums[4*k..4*k+3].
+/// Block sums are added by a pairwise reduction in fixed order, hence the result is
+/// the same for any number of threads.
+void ComputeMStepSums(HashProbabilisticAtlas &output, const RealImage &input, const ByteImage &mask,
+                      const Array<int> &active, int number_of_tissues, const double *shift, Array<double> &sums)
+{
+  const int n = 4 * number_of_tissues;
+  sums.resize(n);
+  if (!output.IsCompact()) {
+    MStepMapBody body;
+    body._input = input.GetPointerToVoxels();
+    body._mask = mask.GetPointerToVoxels();
+    body._output = &output;
+    body._shift = shift;
+    body._sums = sums.data();
+    parallel_for(blocked_range<int>(0, number_of_tissues), body);
+    return;
+  }
+
+  const int number_of_voxels = static_cast<int>(active.size());
+  const int block_size = EMBase::MStepBlockSize;
+  const int number_of_blocks = max(1, (number_of_voxels + block_size - 1) / block_size);
+  Array<double> blocks(static_cast<size_t>(number_of_blocks) * n);
+
+  MStepBlockBody body;
+  body._input = input.GetPointerToVoxels();
+  body._active = active.data();
+  body._output = &output;
+  body._shift = shift;
+  body._number_of_voxels = number_of_voxels;
+  body._number_of_tissues = number_of_tissues;
+  body._block_size = block_size;
+  body._sums = blocks.data();
+  parallel_for(blocked_range<int>(0, number_of_blocks), body);
+  ReduceMStepSums(blocks, number_of_blocks, n, sums);
+}
+
+/// Lower bound of the variances, see MStep
+const double MinVariance = 0.005;
+
+} // namespace EMBaseUtils
+using namespace EMBaseUtils;
+
+/// Concurrent insertions into the same hash image are not safe, hence hashed posteriors
+/// are computed for blocks of voxels and then written by one thread per map. With fused
+/// passes the M-step sums are added per block right after its posteriors.
+template <class Body>
+void EMBase::RunEStep(Body &body)
+{
+  const int number_of_voxels = static_cast<int>(_active.size());
+  const int S = MStepBlockSize;
+  body._active = _active.data();
+  body._posteriors = NULL;
+  body._offset = 0;
+
+  const bool fused = BeginMStepSums();
+  FusedEStepBody<Body> fbody;
+  fbody._em = this;
+  fbody._body = &body;
+  fbody._posteriors = NULL;
+  fbody._offset = 0;
+
+  if (_output.IsCompact()) {
+    if (fused) parallel_for(blocked_range<int>(0, (number_of_voxels + S - 1) / S), fbody);
+    else parallel_for(blocked_range<int>(0, number_of_voxels), body);
+    if (fused) EndMStepSums();
+    return;
+  }
+
+  // whole blocks of the M-step sums
+  const int block = min(number_of_voxels, max(1, (1 << 22) / _number_of_tissues / S) * S);
+  Array<ProbabilityPixel> posteriors(static_cast<size_t>(block) * _number_of_tissues);
+  WritePosteriorsBody write;
+  write._active = _active.data();
+  write._output = &_output;
+  write._posteriors = posteriors.data();
+  write._number_of_tissues = _number_of_tissues;
+  body._posteriors = posteriors.data();
+  fbody._posteriors = posteriors.data();
+  for (int begin = 0; begin < number_of_voxels; begin += block) {
+    const int end = min(begin + block, number_of_voxels);
+    body._offset = begin;
+    fbody._offset = begin;
+    if (fused) parallel_for(blocked_range<int>(begin / S, (end + S - 1) / S), fbody);
+    else parallel_for(blocked_range<int>(begin, end), body);
+    write._begin = begin;
+    write._end = end;
+    parallel_for(blocked_range<int>(0, _number_of_tissues), write);
+  }
+  if (fused) EndMStepSums();
+}
+
+bool EMBase::BeginMStepSums()
+{
+  _mstep_sums_valid = false;
+  _fused_wstep_done = false;
+  if (!_fused_iteration) return false;
+  _mstep_shift.assign(_mi.begin(), _mi.end());
+  _mstep_shift.resize(_number_of_tissues, 0);
+  const int number_of_blocks = (static_cast<int>(_active.size()) + MStepBlockSize - 1) / MStepBlockSize;
+  _mstep_blocks.resize(static_cast<size_t>(number_of_blocks) * 4 * _number_of_tissues);
+  return true;
+}
+
+void EMBase::AddMStepBlockSums(int b, const ProbabilityPixel *posteriors, int offset)
+{
+  const int K = _number_of_tissues;
+  const int end = min(static_cast<int>(_active.size()), (b + 1) * MStepBlockSize);
+  if (_fused_wstep) {
+    // W-step of the block, the M-step follows the B-step
+    RealPixel *pw = _weights.GetPointerToVoxels();
+    RealPixel *pe = _estimate.GetPointerToVoxels();
+    for (int a = b * MStepBlockSize; a < end; a++) {
+      const int i = _active[a];
+      double num = 0, den = 0;
+      if (posteriors) {
+        AddWStepSums(posteriors + static_cast<size_t>(a - offset) * K, NULL, K, _mi.data(), _sigma.data(), num, den);
+      } else {
+        AddWStepSums(_output.GetValues(i), _output.GetLabels(i), _output.GetNumberOfValues(i), _mi.data(), _sigma.data(), num, den);
+      }
+      if (den != 0) {
+        pw[i] = den;
+        pe[i] = num/den;
+      } else {
+        pw[i] = _padding;
+        pe[i] = _padding;
+      }
+    }
+    return;
+  }
+
+  const RealPixel *ptr = _input.GetPointerToVoxels();
+  double *sums = &_mstep_blocks[static_cast<size_t>(b) * 4 * K];
+  for (int k = 0; k < 4 * K; k++) sums[k] = 0;
+  for (int a = b * MStepBlockSize; a < end; a++) {
+    const int i = _active[a];
+    if (posteriors) {
+      AddMStepSums(posteriors + static_cast<size_t>(a - offset) * K, NULL, K, ptr[i], _mstep_shift.data(), sums);
+    } else {
+      const ProbabilityPixel *values = _output.GetValues(i);
+      if (values == NULL) continue;
+      AddMStepSums(values, _output.GetLabels(i), _output.GetNumberOfValues(i), ptr[i], _mstep_shift.data(), sums);
+    }
+  }
+}
+
+void EMBase::EndMStepSums()
+{
+  if (_fused_wstep) {
+    _fused_wstep_done = true;
+    return;
+  }
+  const int n = 4 * _number_of_tissues;
+  ReduceMStepSums(_mstep_blocks, static_cast<int>(_mstep_blocks.size() / n), n, _mstep_sums);
+  _mstep_sums_valid = true;
+}
+
+void EMBase::GetMStepSums(Array<double> &shift, Array<double> &sums)
+{
+  // the sums are centred at the previous means
+  shift.assign(_mi.begin(), _mi.end());
+  shift.resize(_number_of_tissues, 0);
+  if (_mstep_sums_valid && _mstep_shift == shift) {
+    sums = _mstep_sums;
+  } else {
+    ComputeMStepSums(_output, _input, _mask, _active, _number_of_tissues, shift.data(), sums);
+  }
+  _mstep_sums_valid = false;
+}
+
+void EMBase::GetRowActiveVoxels(int j, int k, int &begin, int &end) const
+{
+  const int X = _input.GetX();
+  const int first = X * (j + _input.GetY() * k);
+  // the active voxels are in scan order
+  begin = static_cast<int>(std::lower_bound(_active.begin(), _active.end(), first) - _active.begin());
+  end = static_cast<int>(std::lower_bound(_active.begin() + begin, _active.end(), first + X) - _active.begin());
+}
+
+double EMBase::BlockLogLikelihood(int b, const Gaussian *G)
+{
+  LogLikelihoodBody body;
+  body._input = _input.GetPointerToVoxels();
+  body._output = &_output;
+  body._G = G;
+  body._c = NULL;
+  body._number_of_tissues = _number_of_tissues;
+  body._likelihoods = NULL;
+  body._likelihood_rows = NULL;
+  body._active = _active.data();
+  body._number_of_voxels = static_cast<int>(_active.size());
+  body._block_size = MStepBlockSize;
+  body._sums = NULL;
+  return body.Block(b);
+}
+
+double EMBase::AddLogLikelihoodBlocks(Array<double> &blocks)
+{
+  Array<double> sum;
+  ReduceMStepSums(blocks, static_cast<int>(blocks.size()), 1, sum);
+  return sum[0];
+}
+
 EMBase::EMBase(){
 	InitialiseParameters();
 }
@@ -70,6 +701,20 @@ void EMBase::InitialiseParameters()
 	_posteriors_set=false;
 	_has_background=false;
 	_mask_set=false;
+	_dense_storage=false;
+	_sparse_storage=false;
+	_sparse_epsilon=0;
+	_cache_likelihoods=false;
+	_likelihood_table=false;
+	_likelihoods_valid=false;
+	_fused_iteration=false;
+	_fused_wstep=false;
+	_fused_wstep_done=false;
+	_mstep_sums_valid=false;
+	_accelerate=false;
+	_accel_count=0;
+	_accel_extrapolated=false;
+	_accel_f=0;
 }
 
 void EMBase::SetInput(const RealImage &image)
@@ -78,6 +723,8 @@ void EMBase::SetInput(const RealImage &image)
 	_estimate = image;
     _weights = image;
     _number_of_voxels=_input.GetNumberOfVoxels();
+    InvalidateLikelihoods();
+    _mstep_sums_valid = false;
 }
 
 void EMBase::CreateMask()
@@ -108,6 +755,72 @@ void EMBase::CreateMask()
 		_atlas.Next();
 	}
     _mask_set = true;
+    InvalidateLikelihoods();
+    _mstep_sums_valid = false;
+    CreateActiveVoxels();
+
+    // out-of-core, the rows of the masked voxels are mapped from scratch files
+    if (!_scratch_directory.empty()) {
+        _atlas.SetScratchDirectory(_scratch_directory.c_str());
+        _output.SetScratchDirectory(_scratch_directory.c_str());
+    }
+
+    if (_sparse_storage) {
+        _atlas.MakeSparse(_mask, _sparse_epsilon);
+        _output.MakeSparse(_mask, _sparse_epsilon, &_atlas);
+    } else if (_dense_storage || !_scratch_directory.empty()) {
+        _atlas.MakeDense(_mask);
+        _output.MakeDense(_mask);
+    } else {
+        // the passes only visit the active voxels, posteriors outside of the mask are cleared once
+        m = _mask.GetPointerToVoxels();
+        for (int k = 0; k < _number_of_tissues; k++) {
+            Array<int> outside;
+            const auto end = _output.End(k);
+            for (auto it = _output.Begin(k); it != end; ++it) {
+                if (m[it->first] != 1) outside.push_back(it->first);
+            }
+            for (size_t n = 0; n < outside.size(); n++) _output.Put(outside[n], k, 0);
+        }
+    }
+
+    // weights and estimate stay at the padding value outside of the mask
+    m = _mask.GetPointerToVoxels();
+    RealPixel *pw = _weights.GetPointerToVoxels();
+    RealPixel *pe = _estimate.GetPointerToVoxels();
+    for (int i = 0; i < _number_of_voxels; i++) {
+        if (m[i] != 1) pw[i] = pe[i] = _padding;
+    }
+}
+
+void EMBase::CreateActiveVoxels()
+{
+    int i, x, y, z, n;
+    const int X = _mask.GetX(), Y = _mask.GetY(), Z = _mask.GetZ();
+    const BytePixel *m = _mask.GetPointerToVoxels();
+
+    // active ids of all voxels, only needed to link the neighbours
+    Array<int> ids(_number_of_voxels, -1);
+    _active.clear();
+    for (i = 0; i < _number_of_voxels; i++) {
+        if (m[i] == 1) {
+            ids[i] = static_cast<int>(_active.size());
+            _active.push_back(i);
+        }
+    }
+
+    const int offsets[6] = {-X*Y, -X, -1, 1, X, X*Y};
+    const int N = static_cast<int>(_active.size());
+    _active_neighbours.resize(static_cast<size_t>(N) * 6);
+    for (int a = 0; a < N; a++) {
+        i = _active[a];
+        _mask.IndexToVoxel(i, x, y, z);
+        const bool inside[6] = {z > 0, y > 0, x > 0, x < X-1, y < Y-1, z < Z-1};
+        for (n = 0; n < 6; n++) {
+            _active_neighbours[6*a+n] = inside[n] ? ids[i + offsets[n]] : a;
+        }
+    }
+    std::cout << "Active voxels: " << N << " of " << _number_of_voxels << std::endl;
 }
 
 void EMBase::SetMask(ByteImage &mask)
@@ -153,18 +866,19 @@ void EMBase::setPostPenalty(RealImage &pp){
 
 void EMBase::UniformPrior()
 {
-	int i, k;
-
-	_atlas.First();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-    for (i=0; i< _number_of_voxels; i++) {
-		if (*pm == 1) {
-			for (k = 0; k < _number_of_tissues; k++) {
-				_atlas.SetValue(k,1.0/_number_of_tissues);
-			}
+	int a, k;
+
+	// all structures get a prior, sparse rows would drop them
+	if (_atlas.IsSparse()) {
+		std::cerr << "Warning: uniform priors need all structures, storing atlas and posteriors densely from now on" << std::endl;
+		_atlas.MakeDense(_mask);
+		_output.MakeDense(_mask);
+		_mstep_sums_valid = false;
+	}
+    for (a = 0; a < static_cast<int>(_active.size()); a++) {
+		for (k = 0; k < _number_of_tissues; k++) {
+			_atlas.Put(_active[a], k, 1.0/_number_of_tissues);
 		}
-		pm++;
-		_atlas.Next();
 	}
 }
 
@@ -215,10 +929,12 @@ void EMBase::MStep()
   Array<double> sigma_num(_number_of_tissues);
   Array<double> denom(_number_of_tissues);
 
+  // single pass, the sums are centred at the previous means
+  Array<double> shift, sums;
+  GetMStepSums(shift, sums);
 	for (k = 0; k < _number_of_tissues; k++) {
-    mi_num[k] = 0;
-    sigma_num[k] = 0;
-		denom[k] = 0;
+    denom[k] = sums[4*k];
+    mi_num[k] = sums[4*k+1] + shift[k] * sums[4*k];
 	}
 
 	//superlabels
@@ -233,34 +949,6 @@ void EMBase::MStep()
       denom_super[k]=0;
     }
   }
-  for (k = 0; k < _number_of_tissues; k++) {
-    const auto end = _output.End(k);
-    for (auto it = _output.Begin(k); it != end; ++it) {
-      if (_mask.Get(it->first)==1) {
-        mi_num[k] += it->second * _input.Get(it->first);
-        denom[k]  += it->second;
-      }
-    }
-  }
-
-    /*
-	_output.First();
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-
-    for (i = 0; i < _number_of_voxels; i++) {
-		if (*pm == 1) {
-            for (k = 0; k < _number_of_tissues; k++) {
-				mi_num[k] += _output.GetValue(k) * *ptr;
-				denom[k]  += _output.GetValue(k);
-			}
-		}
-		ptr++;
-		pm++;
-
-		_output.Next();
-    }*/
-
 
 	//superlabels
   if(_superlabels) {
@@ -283,32 +971,12 @@ void EMBase::MStep()
 		}
 	}
 
+  // sum of p*(x-mi)^2 from the sums centred at the previous means
   for (k = 0; k < _number_of_tissues; k++) {
-    const auto end = _output.End(k);
-    for (auto it = _output.Begin(k); it != end; ++it) {
-      if (_mask.Get(it->first)==1) {
-        sigma_num[k] += it->second * pow(_input.Get(it->first) - _mi[k],2);
-      }
-    }
+    const double d = _mi[k] - shift[k];
+    sigma_num[k] = sums[4*k+2] - 2 * d * sums[4*k+1] + d * d * sums[4*k];
   }
 
-    /*
-	_output.First();
-	ptr = _input.GetPointerToVoxels();
-	pm = _mask.GetPointerToVoxels();
-
-    for (i = 0; i < _number_of_voxels; i++) {
-		if (*pm == 1) {
-			for (k = 0; k <_number_of_tissues; k++) {
-				sigma_num[k] += (_output.GetValue(k) * (*ptr - _mi[k]) * (*ptr - _mi[k]));
-			}
-		}
-		ptr++;
-		pm++;
-
-		_output.Next();
-    }*/
-
 	//superlabels
   if(_superlabels){
 		for (k = 0; k < _number_of_tissues; k++) {
@@ -321,140 +989,99 @@ void EMBase::MStep()
 
   for (k = 0; k <_number_of_tissues; k++) {
 		_sigma[k] = sigma_num[k] / denom[k];
-		_sigma[k] = max( _sigma[k], 0.005 );
+		_sigma[k] = max( _sigma[k], MinVariance );
 	}
 }
 
 void EMBase::EStep()
 {
   std::cout << "E-step" << std::endl;
-	int i, k;
-	double x;
+	int k;
 
-	RealImage segmentation;
   Array<Gaussian> G(_number_of_tissues);
 	for (k = 0; k < _number_of_tissues; k++) {
 		G[k].Initialise(_mi[k], _sigma[k]);
 	}
 
-	RealPixel *pptr = nullptr;
-  if (_postpen) pptr = _postpenalty.GetPointerToVoxels();
-
-	Array<double> likelihood(_number_of_tissues);
-  double sumlike;
-
-	_atlas.First();
-	_output.First();
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-  Array<double> numerator(_number_of_tissues);
-  double denominator, temp;
-  for (i=0; i< _number_of_voxels; i++) {
-		if (*pm == 1) {
-			x = *ptr;
-      sumlike=0;
-			for (k = 0; k < _number_of_tissues; k++) {
-				likelihood[k] = G[k].Evaluate(x);
-        sumlike += likelihood[k];
-			}
-			for (k = 0; k < _number_of_tissues; k++) {
-				likelihood[k] /= sumlike;
-			}
-      denominator=0;
-			for (k = 0; k < _number_of_tissues; k++) {
-				temp = likelihood[k] * _atlas.GetValue(k);
-				numerator[k] = temp;
-				denominator += temp;
-			}
-
-			//model averaging
-      if (_postpen && denominator != 0) {
-				double olddenom=denominator;
-				denominator=0;
-				for (k = 0; k < _number_of_tissues; k++) {
-					double value = numerator[k]/olddenom;
-					double priorvalue=_atlas.GetValue(k);
-					value=(1-*pptr)*value +*pptr *  priorvalue;
-					numerator[k] = value;
-					denominator += value;
-				}
-			}
-
-			for (k = 0; k < _number_of_tissues; k++) {
-				if (denominator != 0) {
-					double value = numerator[k]/denominator;
-					if ((value < 0) || (value > 1)) {
-						int x,y,z;
-						_input.IndexToVoxel(i, x, y, z);
-						std::cerr << "Probability value = " << value <<" @ Estep at voxel "<< x<<" "<<y<<" "<<z<< ", structure " << k << std::endl;
-						if (value < 0)value=0;
-						if (value > 1)value=1;
-					}
-          _output.SetValue(k, value);
-        } else {
-          _output.SetValue(k,_atlas.GetValue(k));
-				}
-			}
+  EStepBody body;
+  body._input = &_input;
+  body._postpenalty = _postpen ? _postpenalty.GetPointerToVoxels() : NULL;
+  body._atlas = &_atlas;
+  body._output = &_output;
+  body._G = G.data();
+  body._number_of_tissues = _number_of_tissues;
+  body._likelihoods = UpdateLikelihoods();
+  body._likelihood_rows = _likelihood_rows.data();
+  RunEStep(body);
+}
 
-      if (denominator == 0) {
-        int x,y,z;
-        _input.IndexToVoxel(i, x, y, z);
-        std::cerr<<"Division by 0 while computing probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
+const double *EMBase::UpdateLikelihoods()
+{
+  int a, k;
+  if (!_cache_likelihoods && !_likelihood_table) return NULL;
+  const bool rebuild = !_likelihoods_valid;
+  if (!rebuild && _likelihood_mi == _mi && _likelihood_sigma == _sigma) return _likelihoods.data();
+
+  // intensities of the rows, one per active voxel or one per distinct intensity of the table
+  const RealPixel *ptr = _input.GetPointerToVoxels();
+  const int N = static_cast<int>(_active.size());
+  if (rebuild) {
+    _likelihood_rows.resize(N);
+    if (_likelihood_table) {
+      _likelihood_values.resize(N);
+      for (a = 0; a < N; a++) _likelihood_values[a] = ptr[_active[a]];
+      sort(_likelihood_values.begin(), _likelihood_values.end());
+      _likelihood_values.erase(unique(_likelihood_values.begin(), _likelihood_values.end()), _likelihood_values.end());
+      for (a = 0; a < N; a++) {
+        const double x = ptr[_active[a]];
+        _likelihood_rows[a] = static_cast<int>(lower_bound(_likelihood_values.begin(), _likelihood_values.end(), x) - _likelihood_values.begin());
       }
-		} else {
-			for (k = 0; k < _number_of_tissues ; k++) {
-				_output.SetValue(k, 0);
-			}
-		}
-		ptr++;
-		pm++;
-    if(_postpen) pptr++;
-		_atlas.Next();
-    _output.Next();
-	}
+      std::cout << "Likelihood table of " << _likelihood_values.size() << " intensities" << std::endl;
+    } else {
+      _likelihood_values.resize(N);
+      for (a = 0; a < N; a++) {
+        _likelihood_rows[a] = a;
+        _likelihood_values[a] = ptr[_active[a]];
+      }
+    }
+  }
+
+  Array<Gaussian> G(_number_of_tissues);
+  for (k = 0; k < _number_of_tissues; k++) {
+    G[k].Initialise(_mi[k], _sigma[k]);
+  }
+  _likelihoods.resize(_likelihood_values.size() * _number_of_tissues);
+
+  LikelihoodCacheBody body;
+  body._values = _likelihood_values.data();
+  body._G = G.data();
+  body._number_of_tissues = _number_of_tissues;
+  body._likelihoods = _likelihoods.data();
+  parallel_for(blocked_range<int>(0, static_cast<int>(_likelihood_values.size())), body);
+
+  _likelihood_mi = _mi;
+  _likelihood_sigma = _sigma;
+  _likelihoods_valid = true;
+  return _likelihoods.data();
 }
 
 
 void EMBase::WStep()
 {
   std::cout << "W-step" << std::endl;
-	int i,k;
-	double num, den;
   std::cout<<"Calculating weights ...";
-	RealPixel *pi=_input.GetPointerToVoxels();
-  RealPixel *pw=_weights.GetPointerToVoxels();
-	RealPixel *pe=_estimate.GetPointerToVoxels();
-	BytePixel *pm=_mask.GetPointerToVoxels();
-	_output.First();
-	_atlas.First();
 
-  for (i=0; i< _number_of_voxels; i++) {
-    if (*pm == 1){
-			num=0;
-			den=0;
-			for (k=0; k<_number_of_tissues; k++) {
-				num += _output.GetValue(k)*_mi[k]/_sigma[k];
-				den += _output.GetValue(k)/_sigma[k];
-			}
-      if (den!=0){
-        *pw=den;
-        *pe=num/den;
-      } else {
-        *pw=_padding;
-        *pe=_padding;
-      }
-		} else {
-			*pw=_padding;
-			*pe=_padding;
-		}
+  WStepBody body;
+  body._active = _active.data();
+  body._output = &_output;
+  body._mi = _mi.data();
+  body._sigma = _sigma.data();
+  body._number_of_tissues = _number_of_tissues;
+  body._weights = _weights.GetPointerToVoxels();
+  body._estimate = _estimate.GetPointerToVoxels();
+  body._padding = _padding;
+  parallel_for(blocked_range<int>(0, static_cast<int>(_active.size())), body);
 
-		pi++;
-		pm++;
-    pw++;
-		pe++;
-		_output.Next();
-		_atlas.Next();
-	}
   std::cout<<"done."<<std::endl;
 }
 
@@ -481,43 +1108,15 @@ void EMBase::MStepGMM(bool uniform_prior)
   Array<double> denom(_number_of_tissues);
   Array<double> num_vox(_number_of_tissues);
 
+  // single pass, the sums are centred at the previous means
+  Array<double> shift, sums;
+  GetMStepSums(shift, sums);
 	for (k = 0; k < _number_of_tissues; k++) {
-    mi_num[k] = 0;
-    sigma_num[k] = 0;
-    denom[k] = 0;
-		num_vox[k] = 0;
+    denom[k] = sums[4*k];
+    mi_num[k] = sums[4*k+1] + shift[k] * sums[4*k];
+		num_vox[k] = sums[4*k+3];
 	}
 
-  for (k = 0; k < _number_of_tissues; k++) {
-    const auto end=_output.End(k);
-    for (auto it = _output.Begin(k); it != end; ++it) {
-      if (_mask.Get(it->first)==1) {
-        mi_num[k] += it->second * _input.Get(it->first);
-        denom[k]  += it->second;
-        num_vox[k]+= 1;
-      }
-    }
-  }
-
-    /*
-	_output.First();
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-
-    for (i = 0; i < _number_of_voxels; i++) {
-		// Check for backgound
-		if (*pm == 1) {
-			for (k = 0; k < _number_of_tissues; k++) {
-				mi_num[k] += _output.GetValue(k) * *ptr;
-				denom[k]  += _output.GetValue(k);
-				num_vox[k]+= 1;
-			}
-		}
-		ptr++;
-		pm++;
-		_output.Next();
-    }*/
-
 	for (k = 0; k < _number_of_tissues; k++) {
 		if (denom[k] != 0) {
 			_mi[k] = mi_num[k] / denom[k];
@@ -529,32 +1128,9 @@ void EMBase::MStepGMM(bool uniform_prior)
 		else _c[k]=denom[k]/num_vox[k];
 	}
 
-
-  for (k = 0; k < _number_of_tissues; k++) {
-    const auto end=_output.End(k);
-    for (auto it = _output.Begin(k); it != end; ++it) {
-      if (_mask.Get(it->first)==1) {
-        sigma_num[k] += it->second * pow(_input.Get(it->first) - _mi[k],2);
-      }
-    }
-  }
-
-    /*_output.First();
-	ptr = _input.GetPointerToVoxels();
-	pm = _mask.GetPointerToVoxels();
-
-    for (i = 0; i < _number_of_voxels; i++) {
-		if (*pm == 1) {
-			for (k = 0; k <_number_of_tissues; k++) {
-				sigma_num[k] += (_output.GetValue(k) * (*ptr - _mi[k]) * (*ptr - _mi[k]));
-			}
-		}
-		ptr++;
-		pm++;
-		_output.Next();
-    }*/
-
 	for (k = 0; k <_number_of_tissues; k++) {
+    const double d = _mi[k] - shift[k];
+    sigma_num[k] = sums[4*k+2] - 2 * d * sums[4*k+1] + d * d * sums[4*k];
 		_sigma[k] = sigma_num[k] / denom[k];
 		if(_sigma[k]<1) _sigma[k] = 1;
 	}
@@ -569,42 +1145,15 @@ void EMBase::MStepVarGMM(bool uniform_prior)
   Array<double> num_vox(_number_of_tissues);
   double sigma_num = 0;
 
+  // single pass, the sums are centred at the previous means
+  Array<double> shift, sums;
+  GetMStepSums(shift, sums);
 	for (k = 0; k < _number_of_tissues; k++) {
-		mi_num[k] = 0;
-    denom[k] = 0;
-    num_vox[k] = 0;
+		denom[k] = sums[4*k];
+    mi_num[k] = sums[4*k+1] + shift[k] * sums[4*k];
+    num_vox[k] = sums[4*k+3];
   }
 
-  for (k = 0; k < _number_of_tissues; k++) {
-    const auto end=_output.End(k);
-    for (auto it = _output.Begin(k); it != end; ++it) {
-      if (_mask.Get(it->first)==1){
-        mi_num[k] += it->second * _input.Get(it->first);
-        denom[k]  += it->second;
-        num_vox[k]+= 1;
-      }
-    }
-  }
-
-    /*
-	_output.First();
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-
-    for (i = 0; i < _number_of_voxels; i++) {
-		if (*pm == 1) {
-			for (k = 0; k < _number_of_tissues; k++) {
-				mi_num[k] += _output.GetValue(k) * *ptr;
-				denom[k]  += _output.GetValue(k);
-				num_vox[k]+= 1;
-			}
-		}
-		ptr++;
-		pm++;
-		_output.Next();
-    }*/
-
-
 	for (k = 0; k < _number_of_tissues; k++) {
 		if (denom[k] != 0) {
 			_mi[k] = mi_num[k] / denom[k];
@@ -616,30 +1165,10 @@ void EMBase::MStepVarGMM(bool uniform_prior)
 		else _c[k]=denom[k]/num_vox[k];
 	}
 
-  for (k = 0; k < _number_of_tissues; k++) {
-    const auto end=_output.End(k);
-    for (auto it = _output.Begin(k); it != end; ++it) {
-      if (_mask.Get(it->first)==1){
-        sigma_num += it->second * pow(_input.Get(it->first) - _mi[k],2);
-      }
-    }
-  }
-
-    /*
-	_output.First();
-	ptr = _input.GetPointerToVoxels();
-	pm = _mask.GetPointerToVoxels();
-
-    for (i = 0; i < _number_of_voxels; i++) {
-		if (*pm == 1) {
-			for (k = 0; k <_number_of_tissues; k++) {
-				sigma_num += (_output.GetValue(k) * (*ptr - _mi[k]) * (*ptr - _mi[k]));
-			}
-		}
-		ptr++;
-		pm++;
-		_output.Next();
-    }*/
+	for (k = 0; k < _number_of_tissues; k++) {
+    const double d = _mi[k] - shift[k];
+    sigma_num += sums[4*k+2] - 2 * d * sums[4*k+1] + d * d * sums[4*k];
+	}
 
 	double sum =0;
 	for (k = 0; k <_number_of_tissues; k++) sum += denom[k];
@@ -652,63 +1181,23 @@ void EMBase::MStepVarGMM(bool uniform_prior)
 void EMBase::EStepGMM(bool uniform_prior)
 {
   std::cout << "E-step GMM" << std::endl;
-	int i, k;
-	double x;
-	Array<double> gv(_number_of_tissues);
-	Array<double> numerator(_number_of_tissues);
+	int k;
 	Array<Gaussian> G(_number_of_tissues);
 
 	for (k = 0; k < _number_of_tissues; k++) {
 		G[k].Initialise( _mi[k], _sigma[k]);
 	}
 
-	_output.First();
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-
-  for (i=0; i< _number_of_voxels; i++) {
-	  double denominator=0, temp=0;
-		if (*pm == 1) {
-			x = *ptr;
-			for (k = 0; k < _number_of_tissues; k++) {
-				temp = G[k].Evaluate(x);
-				gv[k] = temp;
-				if (!uniform_prior) temp = temp * _c[k];
-				numerator[k] = temp;
-				denominator += temp;
-			}
-			for (k = 0; k < _number_of_tissues; k++) {
-				if (denominator != 0) {
-					double value = numerator[k]/denominator;
-
-					if ((value < 0) || (value > 1)) {
-						int x,y,z;
-						_input.IndexToVoxel(i, x, y, z);
-						std::cerr << "Probability value = " << value <<" @ Estep gmm at voxel "<< x<<" "<<y<<" "<<z<< ", structure " << k << std::endl;
-						if (value < 0)value=0;
-						if (value > 1)value=1;
-					}
-          _output.SetValue(k, value);
-        } else {
-          _output.SetValue(k,_atlas.GetValue(k));
-				}
-      }
-
-      if (denominator <= 0) {
-        int x,y,z;
-        _input.IndexToVoxel(i, x, y, z);
-        std::cerr<<"Division by 0 while computing probabilities at voxel "<<x<<","<<y<<","<<z<<std::endl;
-      }
-
-		} else {
-			for (k = 0; k < _number_of_tissues ; k++) {
-				_output.SetValue(k, 0);
-      }
-		}
-		ptr++;
-		pm++;
-		_output.Next();
-	}
+  EStepGMMBody body;
+  body._input = &_input;
+  body._atlas = &_atlas;
+  body._output = &_output;
+  body._G = G.data();
+  body._c = uniform_prior ? NULL : _c.data();
+  body._number_of_tissues = _number_of_tissues;
+  body._likelihoods = UpdateLikelihoods();
+  body._likelihood_rows = _likelihood_rows.data();
+  RunEStep(body);
 }
 
 void EMBase::Print()
@@ -744,7 +1233,7 @@ double EMBase::Iterate(int)
 	this->EStep();
 	this->MStep();
 	Print();
-	return LogLikelihood();
+	return Accelerate(LogLikelihood());
 }
 
 double EMBase::IterateGMM(int iteration, bool equal_var, bool uniform_prior)
@@ -758,51 +1247,56 @@ double EMBase::IterateGMM(int iteration, bool equal_var, bool uniform_prior)
 
 double EMBase::LogLikelihood()
 {
-	int i, k;
-	double temp, f;
+	int k;
+	double f;
   std::cout<< "Log likelihood: ";
 	Array<Gaussian> G(_number_of_tissues);
-	Array<double> gv(_number_of_tissues);
 
 	for (k = 0; k < _number_of_tissues; k++) {
 		G[k].Initialise( _mi[k], _sigma[k]);
 	}
 
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-	_output.First();
-	f = 0;
-  for (i = 0; i < _number_of_voxels; i++) {
-    if (*pm == 1) {
-			temp = 0;
-			double max = 0;
-			int max_k = 0;
-
-			for (k=0; k < _number_of_tissues; k++) {
-				// Estimation of gaussian probability of intensity (*ptr) for tissue k
-				gv[k] = G[k].Evaluate(*ptr);
-				if( gv[k] > 1 ) gv[k] = 1.0;
-
-				if( max < gv[k] )
-				{
-					max_k = k;
-					max = gv[k];
-				}
+  LogLikelihoodBody body;
+  body._input = _input.GetPointerToVoxels();
+  body._output = &_output;
+  body._G = G.data();
+  body._c = NULL;
+  body._number_of_tissues = _number_of_tissues;
+  body._likelihoods = UpdateLikelihoods();
+  body._likelihood_rows = _likelihood_rows.data();
+  body._active = _active.data();
+	f = SumLogLikelihood(body, static_cast<int>(_active.size()));
+
+	return UpdateLogLikelihood(-f);
+}
 
-				// Probability that current voxel is from tissue k
-				temp += gv[k] * _output.GetValue(k);
-			}
+double EMBase::LogLikelihoodGMM()
+{
+	int k;
+	double f;
+  std::cout<< "Log likelihood GMM: ";
+	Array<Gaussian> G(_number_of_tissues);
 
-			if ((temp > 0) && (temp <= 1)) {
-				f += log(temp);
-			}
-		}
-		ptr++;
-		pm++;
-		_output.Next();
+	for (k = 0; k < _number_of_tissues; k++) {
+		G[k].Initialise( _mi[k], _sigma[k]);
 	}
 
-	f = -f;
+  LogLikelihoodBody body;
+  body._input = _input.GetPointerToVoxels();
+  body._output = &_output;
+  body._G = G.data();
+  body._c = _c.data();
+  body._number_of_tissues = _number_of_tissues;
+  body._likelihoods = UpdateLikelihoods();
+  body._likelihood_rows = _likelihood_rows.data();
+  body._active = _active.data();
+	f = SumLogLikelihood(body, static_cast<int>(_active.size()));
+
+	return UpdateLogLikelihood(-f);
+}
+
+double EMBase::UpdateLogLikelihood(double f)
+{
 	double diff, rel_diff;
 	diff = _f-f;
 
@@ -815,52 +1309,105 @@ double EMBase::LogLikelihood()
 	return rel_diff;
 }
 
-double EMBase::LogLikelihoodGMM()
+void EMBase::GetParameters(Array<double> &theta) const
 {
-	int i, k;
-	double temp, f;
-  std::cout<< "Log likelihood GMM: ";
-	Array<Gaussian> G(_number_of_tissues);
-	Array<double> gv(_number_of_tissues);
-
-	for (k = 0; k < _number_of_tissues; k++) {
-		G[k].Initialise( _mi[k], _sigma[k]);
+	theta.resize(2 * _number_of_tissues);
+	for (int k = 0; k < _number_of_tissues; k++) {
+		theta[k] = _mi[k];
+		theta[_number_of_tissues + k] = _sigma[k];
 	}
+}
 
-	RealPixel *ptr = _input.GetPointerToVoxels();
-	BytePixel *pm = _mask.GetPointerToVoxels();
-	_output.First();
-	f = 0;
-  for (i = 0; i < _number_of_voxels; i++) {
-		if (*pm == 1) {
-			temp = 0;
-			for (k=0; k < _number_of_tissues; k++) {
-				// Estimation of gaussian probability of intensity (*ptr) for tissue k
-				gv[k] = G[k].Evaluate(*ptr);
-				// Probability that current voxel is from tissue k
-				temp += gv[k] * _c[k];
-			}
+void EMBase::SetParameters(const Array<double> &theta)
+{
+	for (int k = 0; k < _number_of_tissues; k++) {
+		_mi[k] = theta[k];
+		_sigma[k] = theta[_number_of_tissues + k];
+	}
+}
 
-			if ((temp > 0) && (temp <= 1)) {
-				f += log(temp);
-			}
+// SQUAREM, Varadhan and Roland, Scandinavian Journal of Statistics 2008
+double EMBase::Accelerate(double rel_diff, bool extrapolate)
+{
+	if (!_accelerate) return rel_diff;
+
+	Array<double> theta;
+	GetParameters(theta);
+	const size_t n = theta.size();
+
+	if (_accel_extrapolated) {
+		_accel_extrapolated = false;
+		// _f is the negative log likelihood
+		if (_f > _accel_f && _accel_fallback.size() == n) {
+			std::cout << "Acceleration: likelihood decreased, continuing with plain EM" << std::endl;
+			SetParameters(_accel_fallback);
+			_f = _accel_f;
+			_accel_count = 0;
+			return 1;
 		}
-		ptr++;
-		pm++;
-		_output.Next();
+		// the iteration from the extrapolated parameters starts the next cycle
+		_accel_count = 0;
 	}
 
-	f = -f;
-	double diff, rel_diff;
-	diff = _f-f;
+	// the number of structures changed, e.g. a partial volume class was added
+	if (_accel_count > 0 && _accel_theta0.size() != n) _accel_count = 0;
 
-	if (_f == 0) rel_diff = 1;
-	else rel_diff = diff/_f;
+	if (_accel_count < 2) {
+		if (_accel_count == 0) _accel_theta0 = theta;
+		else                   _accel_theta1 = theta;
+		_accel_count++;
+		return rel_diff;
+	}
 
-	_f=f;
+	// r = theta1 - theta0, v = theta2 - 2 theta1 + theta0, steplength alpha = -|r|/|v| <= -1
+	double rr = 0, vv = 0;
+	size_t j;
+	for (j = 0; j < n; j++) {
+		const double r = _accel_theta1[j] - _accel_theta0[j];
+		const double v = theta[j] - 2 * _accel_theta1[j] + _accel_theta0[j];
+		rr += r * r;
+		vv += v * v;
+	}
+	double alpha = -1;
+	if (vv > 0) alpha = min(-1.0, -sqrt(rr / vv));
+
+	Array<double> extrapolated(n);
+	bool valid = (alpha < -1);
+	for (j = 0; j < n; j++) {
+		const double r = _accel_theta1[j] - _accel_theta0[j];
+		const double v = theta[j] - 2 * _accel_theta1[j] + _accel_theta0[j];
+		extrapolated[j] = _accel_theta0[j] - 2 * alpha * r + alpha * alpha * v;
+		// the variances are bounded as in the M-step
+		if (j >= static_cast<size_t>(_number_of_tissues)) extrapolated[j] = max(extrapolated[j], MinVariance);
+	}
 
-  std::cout << "f= "<< f << " diff = " << diff << " rel_diff = " << rel_diff <<std::endl;
-	return rel_diff;
+	if (!valid || !extrapolate) {
+		// plain EM step, keep the last two iterations
+		_accel_theta0 = _accel_theta1;
+		_accel_theta1 = theta;
+		return rel_diff;
+	}
+
+	std::cout << "Acceleration: extrapolating the parameters with step length " << -alpha << std::endl;
+	_accel_fallback = theta;
+	_accel_f = _f;
+	_accel_extrapolated = true;
+	_accel_count = 0;
+	SetParameters(extrapolated);
+	// the extrapolated parameters are not evaluated yet
+	return 1;
+}
+
+void EMBase::ResetAcceleration()
+{
+	Array<double> theta;
+	GetParameters(theta);
+	if (_accel_extrapolated && _accel_fallback.size() == theta.size()) {
+		SetParameters(_accel_fallback);
+		_f = _accel_f;
+	}
+	_accel_count = 0;
+	_accel_extrapolated = false;
 }
 
 void EMBase::ConstructSegmentation(IntegerImage &segmentation)
@@ -870,41 +1417,41 @@ void EMBase::ConstructSegmentation(IntegerImage &segmentation)
 
   std::cout<<"Constructing segmentation"<<std::endl;
 
-  // Initialize pointers of probability maps
-  _output.First();
-
-  // Initialize segmentation to same size as input
+  // Initialize segmentation to same size as input, voxels outside of the mask are 0
   segmentation = IntegerImage(_input.Attributes());
-  RealPixel *ptr = _input.GetPointerToVoxels();
   int *sptr = segmentation.GetPointerToVoxels();
-  BytePixel *pm = _mask.GetPointerToVoxels();
 
-  for (i = 0; i < _number_of_voxels; i++) {
+  for (int a = 0; a < static_cast<int>(_active.size()); a++) {
+    i = _active[a];
     m = 0;
-    if (*pm == 1) {
-      max  = 0;
-      for (j = 0; j < _number_of_tissues; j++) {
-        if (_output.GetValue(j) > max) {
-          max  = _output.GetValue(j);
+    max  = 0;
+    if (_output.IsCompact()) {
+      const ProbabilityPixel *p = _output.GetValues(i);
+      const int *l = _output.GetLabels(i);
+      const int n = _output.GetNumberOfValues(i);
+      for (int r = 0; r < n; r++) {
+        if (p[r] > max) {
+          j = l ? l[r] : r;
+          max  = p[r];
           m = j+1;
           if ( _has_background && (j+1) == _number_of_tissues) m=0;
         }
       }
-      if(max==0){
-        int x,y,z;
-        int index=i;
-        z = index / (_input.GetX() * _input.GetY());
-        index -= z * (_input.GetX() * _input.GetY());
-        x = index % _input.GetX();
-        y = index / _input.GetX();
-        std::cerr<<"voxel at "<<x<<","<<y<<","<<z<<" has 0 prob"<<std::endl;
+    } else {
+      for (j = 0; j < _number_of_tissues; j++) {
+        if (_output.Get(i, j) > max) {
+          max  = _output.Get(i, j);
+          m = j+1;
+          if ( _has_background && (j+1) == _number_of_tissues) m=0;
+        }
       }
     }
-    *sptr = m;
-    sptr++;
-    ptr++;
-    pm++;
-    _output.Next();
+    if(max==0){
+      int x,y,z;
+      _input.IndexToVoxel(i, x, y, z);
+      std::cerr<<"voxel at "<<x<<","<<y<<","<<z<<" has 0 prob"<<std::endl;
+    }
+    sptr[i] = m;
   }
 }
 
@@ -933,6 +1480,16 @@ void EMBase::WriteProbMap(int i, const char *filename)
 	}
 }
 
+void EMBase::WriteProbMaps(const char *filename, const Array<int> &labels)
+{
+	if (static_cast<int>(labels.size()) <= _number_of_tissues) {
+		_output.WriteProbabilityMaps(filename, labels);
+	} else {
+		std::cerr << "EMBase::WriteProbMaps: No such probability map" << std::endl;
+		exit(1);
+	}
+}
+
 void EMBase::WriteGaussianParameters(const char *file_name, int flag)
 {
   std::cout << "Writing GaussianDistributionParameters: " << file_name << std::endl;
@@ -30,5 +30,19 @@ void Gaussian::Initialise(double mean, double var)
 	_norm = 1. / (sqrt(_var) * sqrt(2.*pi));
 }
 
+// ----------------------------------------------------------------------------
+void Gaussian::Evaluate(const Gaussian *G, int n, const double *x, int m, double *likelihoods)
+{
+	// same expression as Evaluate(x), so tabulated likelihoods equal the exact ones. The libm exp
+	// is not vectorised without a vector math library, the gain is the batching of the callers
+	for (int i = 0; i < m; i++, likelihoods += n) {
+		const double xi = x[i];
+		for (int k = 0; k < n; k++) {
+			const double d = xi - G[k]._mean;
+			likelihoods[k] = G[k]._norm * exp(-.5 * d*d / G[k]._var);
+		}
+	}
+}
+
 
 } // namespace std
@@ -18,39 +18,227 @@
  */
 
 #include "mirtk/HashProbabilisticAtlas.h"
+#include "mirtk/ProbabilityMapsFile.h"
+#include "mirtk/Parallel.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 namespace mirtk {
 
+// Number of row values written to a scratch file at once
+static const size_t ScratchChunk = 1 << 20;
+
+// Creates an unlinked scratch file in the directory, it is removed once closed and unmapped
+static int CreateScratchFile(const string &directory){
+	string name = directory + "/drawem-rows-XXXXXX";
+	Array<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	const int fd = mkstemp(path.data());
+	if (fd < 0) {
+		std::cerr << "HashProbabilisticAtlas: Cannot create scratch file in " << directory << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	unlink(path.data());
+	return fd;
+}
+
+// Appends n values to the scratch file
+static void WriteScratch(int fd, const ProbabilityPixel *values, size_t n){
+	const char *ptr = reinterpret_cast<const char *>(values);
+	size_t bytes = n * sizeof(ProbabilityPixel);
+	while (bytes > 0) {
+		const ssize_t written = write(fd, ptr, bytes);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			std::cerr << "HashProbabilisticAtlas: Cannot write scratch file: " << strerror(errno) << std::endl;
+			exit(1);
+		}
+		ptr += written;
+		bytes -= static_cast<size_t>(written);
+	}
+}
+
+// Maps the scratch file of n values and closes it
+static void *MapScratch(int fd, size_t n){
+	void *mapped = NULL;
+	if (n > 0) {
+		mapped = mmap(NULL, n * sizeof(ProbabilityPixel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mapped == MAP_FAILED) {
+			std::cerr << "HashProbabilisticAtlas: Cannot map scratch file: " << strerror(errno) << std::endl;
+			exit(1);
+		}
+	}
+	close(fd);
+	return mapped;
+}
+
 HashProbabilisticAtlas::HashProbabilisticAtlas(){
 	_number_of_voxels = 0;
 	_number_of_maps = 0;
 	_position = 0;
 	_has_background = false;
 	_segmentation = NULL;
+	_compact = false;
+	_sparse = false;
+	_epsilon = 0;
+	_number_of_rows = 0;
+	_data = NULL;
+	_mapped = NULL;
+	_mapped_bytes = 0;
+}
+
+HashProbabilisticAtlas::HashProbabilisticAtlas(const HashProbabilisticAtlas &atlas){
+	_number_of_voxels = 0;
+	_number_of_maps = 0;
+	_position = 0;
+	_has_background = false;
+	_segmentation = NULL;
+	_compact = false;
+	_sparse = false;
+	_epsilon = 0;
+	_number_of_rows = 0;
+	_data = NULL;
+	_mapped = NULL;
+	_mapped_bytes = 0;
+	*this = atlas;
 }
 
 HashProbabilisticAtlas::~HashProbabilisticAtlas(){
 	if (_segmentation) delete _segmentation;
 	for(int i=0; i<_images.size(); i++) delete _images[i];
+	Unmap();
+}
+
+void HashProbabilisticAtlas::Unmap(){
+	if (_mapped) munmap(_mapped, _mapped_bytes);
+	_mapped = NULL;
+	_mapped_bytes = 0;
+}
+
+void HashProbabilisticAtlas::StoreValues(const ProbabilityPixel *values, size_t n){
+	Unmap();
+	if (_scratch_directory.empty() || n == 0) {
+		_values.assign(values, values + n);
+		_data = _values.data();
+		return;
+	}
+	const int fd = CreateScratchFile(_scratch_directory);
+	for (size_t i = 0; i < n; i += ScratchChunk) {
+		WriteScratch(fd, values + i, min(ScratchChunk, n - i));
+	}
+	Array<ProbabilityPixel>().swap(_values);
+	_mapped = MapScratch(fd, n);
+	_mapped_bytes = n * sizeof(ProbabilityPixel);
+	_data = static_cast<ProbabilityPixel *>(_mapped);
 }
 
 HashProbabilisticAtlas& HashProbabilisticAtlas::operator=(const HashProbabilisticAtlas &atlas)
 {
   if (this != &atlas) {
 	if (_segmentation) delete _segmentation;
+	_segmentation = NULL;
 	for(int i=0; i<_images.size(); i++) delete _images[i];
-	int N=atlas.GetNumberOfMaps();
-	for(int i=0; i<N; i++) AddImage(atlas.GetImage(i));
+	_images.clear();
+	_number_of_maps = 0;
+	_has_background = false;
+	_compact = atlas._compact;
+	_sparse = atlas._sparse;
+	_epsilon = atlas._epsilon;
+	if (_scratch_directory.empty()) _scratch_directory = atlas._scratch_directory;
+	if (_compact) {
+		StoreValues(atlas._data, atlas._offsets.empty() ? 0 : atlas._offsets.back());
+		_offsets = atlas._offsets;
+		_labels = atlas._labels;
+		_label_offsets = atlas._label_offsets;
+		_rows = atlas._rows;
+		_number_of_rows = atlas._number_of_rows;
+		_attributes = atlas._attributes;
+		_number_of_voxels = atlas._number_of_voxels;
+		_number_of_maps = atlas._number_of_maps;
+	} else {
+		Unmap();
+		_values.clear();
+		_data = NULL;
+		_offsets.clear();
+		_labels.clear();
+		_label_offsets.clear();
+		_rows.clear();
+		_number_of_rows = 0;
+		int N=atlas.GetNumberOfMaps();
+		for(int i=0; i<N; i++) AddImage(atlas.GetImage(i));
+	}
 	_has_background = atlas.HasBackground();
   }
   return *this;
 }
 
+void HashProbabilisticAtlas::Swap(HashProbabilisticAtlas &atlas)
+{
+	std::swap(_images, atlas._images);
+	std::swap(_number_of_voxels, atlas._number_of_voxels);
+	std::swap(_number_of_maps, atlas._number_of_maps);
+	std::swap(_segmentation, atlas._segmentation);
+	std::swap(_position, atlas._position);
+	std::swap(_has_background, atlas._has_background);
+	std::swap(_compact, atlas._compact);
+	std::swap(_sparse, atlas._sparse);
+	std::swap(_epsilon, atlas._epsilon);
+	// _data points into _values or the mapped file, both move with it
+	std::swap(_values, atlas._values);
+	std::swap(_scratch_directory, atlas._scratch_directory);
+	std::swap(_data, atlas._data);
+	std::swap(_mapped, atlas._mapped);
+	std::swap(_mapped_bytes, atlas._mapped_bytes);
+	std::swap(_offsets, atlas._offsets);
+	std::swap(_labels, atlas._labels);
+	std::swap(_label_offsets, atlas._label_offsets);
+	std::swap(_rows, atlas._rows);
+	std::swap(_number_of_rows, atlas._number_of_rows);
+	std::swap(_attributes, atlas._attributes);
+}
+
 void HashProbabilisticAtlas::SwapImages(int a, int b){
 	if( a >= _number_of_maps || b >= _number_of_maps ){
 		std::cerr << "cannot swap images, index out of bounds!" << std::endl;
 		return;
 	}
+	if (_compact) {
+		for (int r = 0; r < _number_of_rows; r++) {
+			ProbabilityPixel *values = _data + _offsets[r];
+			const int n = static_cast<int>(_offsets[r+1] - _offsets[r]);
+			if (n == _number_of_maps) {
+				ProbabilityPixel tmpvalue = values[a];
+				values[a] = values[b];
+				values[b] = tmpvalue;
+				continue;
+			}
+			// relabel and keep the structures of the row sorted
+			int *labels = &_labels[_label_offsets[r]];
+			for (int j = 0; j < n; j++) {
+				if      (labels[j] == a) labels[j] = b;
+				else if (labels[j] == b) labels[j] = a;
+			}
+			for (int j = 1; j < n; j++) {
+				const int label = labels[j];
+				const ProbabilityPixel value = values[j];
+				int l = j - 1;
+				while (l >= 0 && labels[l] > label) {
+					labels[l+1] = labels[l];
+					values[l+1] = values[l];
+					l--;
+				}
+				labels[l+1] = label;
+				values[l+1] = value;
+			}
+		}
+		return;
+	}
 	HashRealImage *tmpimage = _images[a];
 	_images[a] = _images[b];
 	_images[b] = tmpimage;
@@ -58,19 +246,211 @@ void HashProbabilisticAtlas::SwapImages(int a, int b){
 
 template <class ImageType>
 void HashProbabilisticAtlas::AddImage(ImageType image){
-	if (_images.size() == 0) {
-		_number_of_voxels = image.GetNumberOfVoxels();
+	AddHashImage(new HashRealImage(image));
+}
+
+void HashProbabilisticAtlas::AddHashImage(HashRealImage *image){
+	if (_number_of_maps == 0) {
+		_number_of_voxels = image->GetNumberOfVoxels();
+		_attributes = image->Attributes();
 	} else {
-		if (_number_of_voxels != image.GetNumberOfVoxels()) {
+		if (_number_of_voxels != image->GetNumberOfVoxels()) {
 			std::cerr << "Image sizes mismatch" << std::endl;
 			exit(1);
 		}
 	}
-	_images.push_back(new HashRealImage(image));
+	if (_compact) {
+		// append the new map to the rows
+		Compact(_rows, _number_of_rows, this, image);
+		delete image;
+		if(_has_background) SwapImages(_number_of_maps-2, _number_of_maps-1);
+		return;
+	}
+	_images.push_back(image);
 	if(_has_background) SwapImages(static_cast<int>(_images.size())-2, static_cast<int>(_images.size())-1);
 	_number_of_maps = static_cast<int>(_images.size());
 }
 
+/// Hashes the non-zero values of the maps of a probability maps file
+class AddMapsBody
+{
+public:
+	const ProbabilityMapsFile *_file;
+	HashRealImage **_images;
+
+	void operator ()(const blocked_range<int> &re) const
+	{
+		const ImageAttributes &attr = _file->Attributes();
+		const int n = attr._x * attr._y * attr._z;
+		for (int k = re.begin(); k != re.end(); ++k) {
+			const float *values = _file->GetMap(k);
+			HashRealImage *image = new HashRealImage(attr);
+			for (int i = 0; i < n; i++) {
+				if (values[i] != 0) image->Put(i, values[i]);
+			}
+			_images[k] = image;
+		}
+	}
+};
+
+void HashProbabilisticAtlas::AddMaps(const ProbabilityMapsFile &file){
+	const int K = file.GetNumberOfMaps();
+	Array<HashRealImage *> images(K, NULL);
+	AddMapsBody body;
+	body._file = &file;
+	body._images = images.data();
+	parallel_for(blocked_range<int>(0, K, 1), body);
+	for (int k = 0; k < K; k++) AddHashImage(images[k]);
+}
+
+void HashProbabilisticAtlas::Compact(const Array<int> &rows, int number_of_rows, const HashProbabilisticAtlas *pattern, const HashRealImage *extra){
+	int i, j, n;
+
+	const int N = _number_of_maps + (extra ? 1 : 0);
+	const int background = _has_background ? _number_of_maps-1 : -1;
+	if (pattern && !pattern->_compact) pattern = NULL;
+
+	Array<ProbabilityPixel> values;
+	Array<RealPixel> rowvalues(N);
+	Array<int> labels, rowlabels(N);
+	Array<size_t> offsets(number_of_rows+1), label_offsets(number_of_rows+1);
+	offsets[0] = label_offsets[0] = 0;
+
+	// rows of a scratch file are written in chunks, the values of the other rows are kept in memory
+	const bool scratch = !_scratch_directory.empty();
+	const int fd = scratch ? CreateScratchFile(_scratch_directory) : -1;
+	size_t written = 0;
+	values.reserve(scratch ? ScratchChunk : (_sparse ? number_of_rows : static_cast<size_t>(number_of_rows) * N));
+
+	for (i = 0; i < _number_of_voxels; i++) {
+		const int r = rows[i];
+		if (r < 0) continue;
+
+		// values of all maps at this voxel
+		for (j = 0; j < _number_of_maps; j++) {
+			if (_compact) {
+				const ProbabilityPixel *value = Find(i, j);
+				rowvalues[j] = value ? static_cast<RealPixel>(*value) : 0;
+			} else {
+				rowvalues[j] = _images[j]->Get(i);
+			}
+		}
+		if (extra) rowvalues[N-1] = extra->Get(i);
+
+		// active structures
+		n = 0;
+		for (j = 0; j < N; j++) {
+			bool active;
+			if (!_sparse || j == background) active = true;
+			else if (pattern) {
+				active = (j < pattern->_number_of_maps && pattern->Find(i, j) != NULL);
+				if (extra && j == N-1) active = active || rowvalues[j] > _epsilon;
+			}
+			else active = rowvalues[j] > _epsilon;
+			if (active) rowlabels[n++] = j;
+		}
+
+		// store rows densely when the labels would not save memory
+		if (n == 0 || n * (sizeof(ProbabilityPixel) + sizeof(int)) >= N * sizeof(ProbabilityPixel)) {
+			for (j = 0; j < N; j++) values.push_back(rowvalues[j]);
+		} else {
+			for (j = 0; j < n; j++) {
+				values.push_back(rowvalues[rowlabels[j]]);
+				labels.push_back(rowlabels[j]);
+			}
+		}
+		if (scratch && values.size() >= ScratchChunk) {
+			WriteScratch(fd, values.data(), values.size());
+			written += values.size();
+			values.clear();
+		}
+		offsets[r+1] = written + values.size();
+		label_offsets[r+1] = labels.size();
+	}
+
+	for (j = 0; j < _images.size(); j++) delete _images[j];
+	_images.clear();
+	Unmap();
+	if (scratch) {
+		WriteScratch(fd, values.data(), values.size());
+		written += values.size();
+		Array<ProbabilityPixel>().swap(values);
+		Array<ProbabilityPixel>().swap(_values);
+		_mapped = MapScratch(fd, written);
+		_mapped_bytes = written * sizeof(ProbabilityPixel);
+		_data = static_cast<ProbabilityPixel *>(_mapped);
+	} else {
+		_values.swap(values);
+		_data = _values.data();
+	}
+	_labels.swap(labels);
+	_offsets.swap(offsets);
+	_label_offsets.swap(label_offsets);
+	if (&_rows != &rows) _rows = rows;
+	_number_of_rows = number_of_rows;
+	_number_of_maps = N;
+	_compact = true;
+}
+
+void HashProbabilisticAtlas::MakeDense(const ByteImage &mask){
+	int i, r;
+
+	if (mask.GetNumberOfVoxels() != _number_of_voxels) {
+		std::cerr << "HashProbabilisticAtlas::MakeDense: Mask size mismatch" << std::endl;
+		exit(1);
+	}
+
+	// rows of the masked voxels
+	Array<int> rows(_number_of_voxels);
+	const BytePixel *pm = mask.GetPointerToVoxels();
+	r = 0;
+	for (i = 0; i < _number_of_voxels; i++, pm++) {
+		rows[i] = (*pm == 1) ? r++ : -1;
+	}
+
+	_sparse = false;
+	Compact(rows, r, NULL, NULL);
+}
+
+void HashProbabilisticAtlas::MakeSparse(const ByteImage &mask, double epsilon, const HashProbabilisticAtlas *pattern){
+	int i, r;
+
+	if (mask.GetNumberOfVoxels() != _number_of_voxels) {
+		std::cerr << "HashProbabilisticAtlas::MakeSparse: Mask size mismatch" << std::endl;
+		exit(1);
+	}
+	if (pattern && (pattern->GetNumberOfVoxels() != _number_of_voxels || pattern->GetNumberOfMaps() != _number_of_maps)) {
+		std::cerr << "HashProbabilisticAtlas::MakeSparse: Pattern atlas mismatch" << std::endl;
+		exit(1);
+	}
+
+	// rows of the masked voxels
+	Array<int> rows(_number_of_voxels);
+	const BytePixel *pm = mask.GetPointerToVoxels();
+	r = 0;
+	for (i = 0; i < _number_of_voxels; i++, pm++) {
+		rows[i] = (*pm == 1) ? r++ : -1;
+	}
+
+	_sparse = true;
+	_epsilon = epsilon;
+	Compact(rows, r, pattern, NULL);
+}
+
+void HashProbabilisticAtlas::NotStored(unsigned int mapnr) const{
+	std::cerr << "HashProbabilisticAtlas: Structure " << mapnr << " is not stored at the voxel, the rows must be made dense before it is set" << std::endl;
+	exit(1);
+}
+
+HashRealImage HashProbabilisticAtlas::GetCompactImage(unsigned int mapnr) const{
+	HashRealImage image(_attributes);
+	for (int i = 0; i < _number_of_voxels; i++) {
+		const ProbabilityPixel *value = Find(i, mapnr);
+		if (value && *value != 0) image.Put(i, *value);
+	}
+	return image;
+}
+
 void HashProbabilisticAtlas::NormalizeAtlas(){
 	int i, j;
 
@@ -81,8 +461,31 @@ void HashProbabilisticAtlas::NormalizeAtlas(){
 	} 
 
 	// normalize atlas to 0 to 1
-	this->First();
 	RealPixel norm;
+	if (_compact) {
+		for (i = 0; i < _number_of_rows; i++) {
+			ProbabilityPixel *v = _data + _offsets[i];
+			const int n = static_cast<int>(_offsets[i+1] - _offsets[i]);
+			norm = 0;
+			for (j = 0; j < n; j++) {
+				if (v[j] < 0) v[j] = 0;
+				else norm += v[j];
+			}
+			if (norm>0) {
+				for (j = 0; j < n; j++) v[j] /= norm;
+			} else {
+				// the background is always stored
+				for (j = 0; j < n; j++) v[j] = 0;
+				if(_has_background) {
+					const bool dense = (n == _number_of_maps);
+					if (dense || _labels[_label_offsets[i]+n-1] == _number_of_maps-1) v[n-1] = 1;
+				}
+			}
+		}
+		return;
+	}
+
+	this->First();
 	Array<RealPixel> values(_number_of_maps);
 	for (i = 0; i < _number_of_voxels; i++) {
 		norm = 0;
@@ -113,6 +516,10 @@ void HashProbabilisticAtlas::AddBackground(){
 		std::cerr << "HashProbabilisticAtlas::AddBackground: No probability maps found" << std::endl;
 		exit(1);
 	} 
+	if (_compact) {
+		std::cerr << "HashProbabilisticAtlas::AddBackground: Background must be added before the maps are stored row-wise" << std::endl;
+		exit(1);
+	}
 	this->AddImage(*(_images[0]));
 
 	// normalize atlas to 0 to 1
@@ -154,18 +561,33 @@ void HashProbabilisticAtlas::AddProbabilityMaps(int n, ImageType **atlas){
 
 void HashProbabilisticAtlas::Write(int i, const char *filename){
 	if  (i < _number_of_maps) {
-		_images[i]->Write(filename);
+		GetImage(i).Write(filename);
 	} else {
 		std::cerr << "HashProbabilisticAtlas::Write: No such probability map" << std::endl;
 		exit(1);
 	}
 }
 
+void HashProbabilisticAtlas::WriteProbabilityMaps(const char *filename, const Array<int> &labels) const{
+	if (static_cast<int>(labels.size()) > _number_of_maps) {
+		std::cerr << "HashProbabilisticAtlas::WriteProbabilityMaps: No such probability map" << std::endl;
+		exit(1);
+	}
+	ProbabilityMapsFile file;
+	file.Create(filename, _attributes, labels);
+	Array<float> values(_number_of_voxels);
+	for (size_t k = 0; k < labels.size(); k++) {
+		for (int i = 0; i < _number_of_voxels; i++) values[i] = static_cast<float>(Get(i, k));
+		file.WriteMap(values.data());
+	}
+	file.Close();
+}
+
 HashImage<int> HashProbabilisticAtlas::ComputeHardSegmentation(){
 	int i, mapnr, j = 0;
     RealPixel max = 0;
 
-	if(!_segmentation) _segmentation = new HashImage<int>(_images[0]->Attributes());
+	if(!_segmentation) _segmentation = new HashImage<int>(_attributes);
     (*_segmentation) = -1;
 
 	First();
@@ -173,9 +595,9 @@ HashImage<int> HashProbabilisticAtlas::ComputeHardSegmentation(){
 		max = 0;
 		mapnr = -1;
 		for (j=0; j< GetNumberOfMaps(); j++) {
-			if (_images[j]->Get(i) > max) {
+			if (GetValue(j) > max) {
 				mapnr = j;
-				max = _images[j]->Get(i);
+				max = GetValue(j);
 			}
         }
 		_segmentation->Put(i, mapnr);
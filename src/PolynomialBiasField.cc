@@ -21,6 +21,8 @@
 #include "mirtk/Matrix.h"
 #include "mirtk/Vector.h"
 #include "mirtk/Cifstream.h"
+#include "mirtk/Array.h"
+#include "mirtk/Parallel.h"
 
 #include "mirtk/PolynomialBiasField.h"
 #include "mirtk/BiasField.h"
@@ -30,11 +32,16 @@ namespace mirtk {
 
 PolynomialBiasField::PolynomialBiasField()
 {
+	_dop = 0;
+	_coeff = NULL;
+	_numOfCoefficients = 0;
+	_stride = 3;
 }
 
-PolynomialBiasField::PolynomialBiasField(const GreyImage &image, int dop)
+PolynomialBiasField::PolynomialBiasField(const GreyImage &image, int dop, int stride)
 {
 	_dop = dop;
+	_stride = max(1, stride);
 	_numOfCoefficients = getNumberOfCoefficients(dop);
 	_coeff = new double[_numOfCoefficients];
 	memset( _coeff, 0, sizeof(double) * _numOfCoefficients );
@@ -111,101 +118,187 @@ PolynomialBiasField::~PolynomialBiasField()
 //	}
 //}
 
-// ALTERNATIVE IMPLEMENTATION USING symmetry of A'WA, should be by a factor of 2 faster than above implementation
-void PolynomialBiasField::WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no)
+/// Sums the upper triangle of A'WA and A'Wb over fixed blocks of points, where the rows
+/// of A are the monomials at the points. The points are given by arrays or generated from
+/// the voxels of the samples. The block sums do not depend on the number of threads.
+struct PolynomialNormalEquationsBody
 {
-	// just consider each eachs voxel...
-	int each = 3;
-	no /= each;
-
-	Matrix A(no, _numOfCoefficients);
-	Vector vecB(no);
-
-	std::cout << "numOfCoefficients: " << _numOfCoefficients << std::endl;
-	std::cout << "num of voxels: " << no << std::endl;
-
-	double* AtWA = new double[_numOfCoefficients * _numOfCoefficients];
-	memset(AtWA, 0, sizeof(double) * _numOfCoefficients * _numOfCoefficients );
-
-	double* Basis = new double[_numOfCoefficients];
-
-	for( int rr = 0; rr < no; ++rr )
+	const BiasFieldSamples *_samples;
+	const double *_x;
+	const double *_y;
+	const double *_z;
+	const double *_bias;
+	const double *_weights;
+	int           _no;
+	int           _stride;
+	int           _dop;
+	int           _numOfCoefficients;
+	int           _block_size;
+	double       *_sums;
+
+	void operator ()(const blocked_range<int> &re) const
 	{
-		int r = rr * each;
-		double weight = weights[rr*each];
-		vecB.Put(rr,bias[r]);
-
-		double x = x1[r];
-		double y = y1[r];
-		double z = z1[r];
-
-		int c = 0;
-
-		double cur_x = 1.0;
-		double cur_y = 1.0;
+		const int n = _numOfCoefficients;
+		double x, y, z, bias, weight;
+		for (int b = re.begin(); b != re.end(); ++b) {
+			// A'WA, A'Wb and the monomials of a point
+			double *AtWA = _sums + static_cast<size_t>(b) * (n * n + 2 * n);
+			double *AtWb = AtWA + n * n;
+			double *basis = AtWb + n;
+			memset(AtWA, 0, sizeof(double) * (n * n + n));
+			const int end = min(_no, (b + 1) * _block_size);
+			for (int rr = b * _block_size; rr < end; rr++) {
+				const int r = rr * _stride;
+				if (_samples) {
+					const int index = _samples->Index(r);
+					if (index < 0) continue;
+					weight = _samples->_weights[index];
+					if (weight == 0) continue;
+					_samples->World(index, x, y, z);
+					bias = _samples->_target[index] - (double) _samples->_reference[index];
+				} else {
+					weight = _weights[r];
+					if (weight == 0) continue;
+					x = _x[r];
+					y = _y[r];
+					z = _z[r];
+					bias = _bias[r];
+				}
 
-		for( int xd = 0; xd <= _dop; ++xd )
-		{
-			cur_y = 1.0;
-			for( int yd = 0; yd <= _dop-xd; ++yd )
-			{
-				double tmp = cur_x*cur_y;
-				for( int zd = 0; zd <= _dop-xd-yd; ++zd )
+				int c = 0;
+				double cur_x = 1.0;
+				for( int xd = 0; xd <= _dop; ++xd )
 				{
-					A.Put(rr,c, tmp);
-					Basis[c] = tmp;
-					c++;
-					tmp *= z;
+					double cur_y = 1.0;
+					for( int yd = 0; yd <= _dop-xd; ++yd )
+					{
+						double tmp = cur_x*cur_y;
+						for( int zd = 0; zd <= _dop-xd-yd; ++zd )
+						{
+							basis[c++] = tmp;
+							tmp *= z;
+						}
+						cur_y *= y;
+					}
+					cur_x *= x;
+				}
+
+				for (int j = 0; j < n; j++) {
+					const double wj = weight * basis[j];
+					double *row = AtWA + j * n;
+					for (int i = j; i < n; i++) row[i] += wj * basis[i];
+					AtWb[j] += wj * bias;
 				}
-				cur_y *= y;
 			}
-			cur_x *= x;
 		}
+	}
+};
 
-		double* Aptr = (double*) AtWA;
-		double* Basisptr1 = (double*) Basis;
-		double* Basisptr2;
-
-		for( int j2 = 0; j2 < _numOfCoefficients; j2++, Basisptr1++)
-		{
-			Basisptr2= &Basis[j2];
-			Aptr= &AtWA[j2+j2*_numOfCoefficients];
-			for(int i2=j2; i2<_numOfCoefficients; i2++, Aptr++, Basisptr2++){
-				(*Aptr)+=(*Basisptr2)*(weight)*(*Basisptr1);
-			}
+/// Solves the symmetric positive definite system A x = b by Cholesky decomposition,
+/// A holds the upper triangle (row-wise) and is overwritten. Returns false if A is not positive definite.
+static bool CholeskySolve(double *A, double *b, int n)
+{
+	// A = U'U with U in the upper triangle
+	for (int j = 0; j < n; j++) {
+		double d = A[j*n+j];
+		for (int k = 0; k < j; k++) d -= A[k*n+j] * A[k*n+j];
+		if (!(d > 0)) return false;
+		d = sqrt(d);
+		A[j*n+j] = d;
+		for (int i = j + 1; i < n; i++) {
+			double v = A[j*n+i];
+			for (int k = 0; k < j; k++) v -= A[k*n+j] * A[k*n+i];
+			A[j*n+i] = v / d;
 		}
 	}
+	// U'y = b
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < i; k++) b[i] -= A[k*n+i] * b[k];
+		b[i] /= A[i*n+i];
+	}
+	// Ux = y
+	for (int i = n - 1; i >= 0; i--) {
+		for (int k = i + 1; k < n; k++) b[i] -= A[i*n+k] * b[k];
+		b[i] /= A[i*n+i];
+	}
+	return true;
+}
 
-	Matrix AtW = A;
-	AtW.Transpose();
+void PolynomialBiasField::WeightedLeastSquares(double *x1, double *y1, double *z1, double *bias, double *weights, int no)
+{
+	FitNormalEquations(NULL, x1, y1, z1, bias, weights, no);
+}
 
-	for( int r = 0; r < _numOfCoefficients; ++r)
-	{
-		for( int c= 0; c < no; ++c )
-		{
-			AtW.Put(r,c, AtW(r,c) * weights[c*each] );
-		}
+void PolynomialBiasField::WeightedLeastSquares(const BiasFieldSamples &samples)
+{
+	FitNormalEquations(&samples, NULL, NULL, NULL, NULL, NULL, samples._number_of_voxels);
+}
+
+void PolynomialBiasField::FitNormalEquations(const BiasFieldSamples *samples, double *x1, double *y1, double *z1, double *bias, double *weights, int no)
+{
+	// just consider each _stride-th voxel...
+	no = (no + _stride - 1) / _stride;
+	const int n = _numOfCoefficients;
+	const int size = n * n + 2 * n;
+
+	std::cout << "numOfCoefficients: " << n << std::endl;
+	std::cout << "num of voxels: " << no << std::endl;
+
+	// the block sums and, after them, the summed normal equations and the solution;
+	// the buffer is kept for the next fit
+	const int block_size = NormalEquationsBlockSize;
+	const int number_of_blocks = max(1, (no + block_size - 1) / block_size);
+	_normal_equations.resize(static_cast<size_t>(number_of_blocks + 1) * size);
+
+	PolynomialNormalEquationsBody body;
+	body._samples = samples;
+	body._x = x1;
+	body._y = y1;
+	body._z = z1;
+	body._bias = bias;
+	body._weights = weights;
+	body._no = no;
+	body._stride = _stride;
+	body._dop = _dop;
+	body._numOfCoefficients = n;
+	body._block_size = block_size;
+	body._sums = _normal_equations.data();
+	parallel_for(blocked_range<int>(0, number_of_blocks), body);
+
+	// add the blocks in order
+	double *AtWA = _normal_equations.data() + static_cast<size_t>(number_of_blocks) * size;
+	double *AtWb = AtWA + n * n;
+	double *coeff = AtWb + n;
+	memcpy(AtWA, _normal_equations.data(), sizeof(double) * (n * n + n));
+	for (int b = 1; b < number_of_blocks; b++) {
+		const double *sums = _normal_equations.data() + static_cast<size_t>(b) * size;
+		for (int i = 0; i < n * n + n; i++) AtWA[i] += sums[i];
 	}
 
-	Matrix leftSide(_numOfCoefficients, _numOfCoefficients);
-	for(int j2=0; j2<_numOfCoefficients; j2++)
-	{
-		for(int i2=j2; i2<_numOfCoefficients; i2++)
-		{
-			leftSide.Put(i2,j2,(double)(AtWA[i2+j2*_numOfCoefficients]));
-			leftSide.Put(j2,i2,(double)(AtWA[i2+j2*_numOfCoefficients]));
+	// decompose a copy in the first block, which is no longer needed
+	double *U = _normal_equations.data();
+	memcpy(U, AtWA, sizeof(double) * n * n);
+	memcpy(coeff, AtWb, sizeof(double) * n);
+	if (!CholeskySolve(U, coeff, n)) {
+		// singular normal equations, e.g. too few points for the degree
+		Matrix leftSide(n, n);
+		for (int j = 0; j < n; j++) {
+			for (int i = j; i < n; i++) {
+				leftSide.Put(i, j, AtWA[j*n+i]);
+				leftSide.Put(j, i, AtWA[j*n+i]);
+			}
+		}
+		leftSide.Invert();
+		for (int i = 0; i < n; i++) {
+			coeff[i] = 0;
+			for (int j = 0; j < n; j++) coeff[i] += leftSide(i, j) * AtWb[j];
 		}
 	}
 
-	Vector rightSide = AtW * vecB;
-	leftSide.Invert();
-
-	Vector vecC = leftSide * rightSide;
-
-	for( int r = 0; r < _numOfCoefficients; ++r )
+	for( int r = 0; r < n; ++r )
 	{
-        _coeff[r] = vecC.Get(r);
-    }
+		_coeff[r] = coeff[r];
+	}
 }
 
 double PolynomialBiasField::evaluatePolynomial(double x, double y, double z)
@@ -241,6 +334,37 @@ double PolynomialBiasField::Bias(double x, double y, double z)
 	return evaluatePolynomial(x, y, z);
 }
 
+void PolynomialBiasField::BiasRow(const double *p, const double *d, int n, double *bias)
+{
+	if (_dop > MaxRowDegree) {
+		BiasField::BiasRow(p, d, n, bias);
+		return;
+	}
+
+	double diff[MaxRowDegree+1];
+	for (int first = 0; first < n; first += RowBlockSize) {
+		const int count = min(RowBlockSize, n - first);
+		if (count <= _dop + 1) {
+			for (int i = first; i < first + count; i++) {
+				bias[i] = evaluatePolynomial(p[0] + i * d[0], p[1] + i * d[1], p[2] + i * d[2]);
+			}
+			continue;
+		}
+		// forward differences of order 0.._dop at the first point of the block
+		for (int i = 0; i <= _dop; i++) {
+			const int t = first + i;
+			diff[i] = evaluatePolynomial(p[0] + t * d[0], p[1] + t * d[1], p[2] + t * d[2]);
+		}
+		for (int o = 1; o <= _dop; o++) {
+			for (int i = _dop; i >= o; i--) diff[i] -= diff[i-1];
+		}
+		for (int i = first; i < first + count; i++) {
+			bias[i] = diff[0];
+			for (int o = 0; o < _dop; o++) diff[o] += diff[o+1];
+		}
+	}
+}
+
 void PolynomialBiasField::Interpolate(double* dbias)
 {
 
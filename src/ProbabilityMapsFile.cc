@@ -0,0 +1,308 @@
+/*
+ * Developing brain Region Annotation With Expectation-Maximization (Draw-EM)
+ *
+ * Copyright 2013-2020 Imperial College London
+ * Copyright 2013-2020 Antonios Makropoulos
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mirtk/ProbabilityMapsFile.h"
+#include "mirtk/Parallel.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+
+namespace mirtk {
+
+// Magic number, version and alignment of the first map
+static const char     PMapsMagic[8]  = { 'D', 'R', 'A', 'W', 'E', 'M', 'P', 'M' };
+static const uint32_t PMapsVersion   = 2;
+static const size_t   PMapsAlignment = 4096;
+
+// Number of double attributes: spacing, origin and axes (version 1), then the temporal
+// spacing and origin and the 4x4 scanner matrix (version 2)
+static const int PMapsAttributes[3] = { 0, 15, 33 };
+
+// Size of the header of a version without the labels
+static size_t PMapsHeaderSize(uint32_t version)
+{
+	return sizeof(PMapsMagic) + 2 * sizeof(uint32_t) + 3 * sizeof(int32_t)
+	     + PMapsAttributes[version] * sizeof(double) + sizeof(uint64_t);
+}
+
+// Number of voxels of a map
+static size_t NumberOfVoxels(const ImageAttributes &attr)
+{
+	return static_cast<size_t>(attr._x) * attr._y * attr._z;
+}
+
+/// Loads a batch of maps concurrently, from the maps file or from the image files
+class ReadImagesBody
+{
+public:
+	const ProbabilityMapsFile *_file;
+	char **_filenames;
+	RealImage *_images;
+	int _first;
+
+	void operator ()(const blocked_range<int> &re) const
+	{
+		for (int i = re.begin(); i != re.end(); ++i) {
+			if (_file->GetNumberOfMaps() > 0) _images[i] = _file->GetImage(_first + i);
+			else _images[i].Read(_filenames[_first + i]);
+		}
+	}
+};
+
+ProbabilityMapsFile::ProbabilityMapsFile(){
+	_mapped = NULL;
+	_mapped_bytes = 0;
+	_maps = NULL;
+	_output = NULL;
+	_written = 0;
+}
+
+ProbabilityMapsFile::~ProbabilityMapsFile(){
+	Close();
+}
+
+bool ProbabilityMapsFile::IsProbabilityMapsFile(const char *filename){
+	const size_t n = strlen(filename);
+	return n > 6 && strcmp(filename + n - 6, ".pmaps") == 0;
+}
+
+void ProbabilityMapsFile::Read(const char *filename){
+	Close();
+
+	const int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "ProbabilityMapsFile::Read: Cannot open " << filename << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < PMapsHeaderSize(1)) {
+		std::cerr << "ProbabilityMapsFile::Read: File format not recognized: " << filename << std::endl;
+		exit(1);
+	}
+	_mapped_bytes = static_cast<size_t>(st.st_size);
+	_mapped = mmap(NULL, _mapped_bytes, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (_mapped == MAP_FAILED) {
+		std::cerr << "ProbabilityMapsFile::Read: Cannot map " << filename << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+
+	// header
+	const char *ptr = static_cast<const char *>(_mapped);
+	uint32_t version;
+	int32_t maps, x, y, z;
+	double values[33];
+	uint64_t offset;
+	bool valid = (memcmp(ptr, PMapsMagic, sizeof(PMapsMagic)) == 0);
+	ptr += sizeof(PMapsMagic);
+	memcpy(&version, ptr, sizeof(version)); ptr += 2 * sizeof(uint32_t);
+	valid = valid && (version == 1 || version == PMapsVersion) && PMapsHeaderSize(version) <= _mapped_bytes;
+	if (!valid) {
+		std::cerr << "ProbabilityMapsFile::Read: File format not recognized: " << filename << std::endl;
+		exit(1);
+	}
+	const size_t attributes = PMapsAttributes[version] * sizeof(double);
+	memcpy(&maps,    ptr, sizeof(maps));    ptr += sizeof(maps);
+	memcpy(&x,       ptr, sizeof(x));       ptr += sizeof(x);
+	memcpy(&y,       ptr, sizeof(y));       ptr += sizeof(y);
+	memcpy(&z,       ptr, sizeof(z));       ptr += sizeof(z);
+	memcpy(values,   ptr, attributes);      ptr += attributes;
+	memcpy(&offset,  ptr, sizeof(offset));  ptr += sizeof(offset);
+	valid = valid && maps >= 0 && x > 0 && y > 0 && z > 0;
+	valid = valid && PMapsHeaderSize(version) + maps * sizeof(int32_t) <= offset && offset <= _mapped_bytes;
+	if (!valid) {
+		std::cerr << "ProbabilityMapsFile::Read: File format not recognized: " << filename << std::endl;
+		exit(1);
+	}
+
+	_attributes = ImageAttributes();
+	_attributes._x = x;
+	_attributes._y = y;
+	_attributes._z = z;
+	_attributes._t = 1;
+	_attributes._dx = values[0];
+	_attributes._dy = values[1];
+	_attributes._dz = values[2];
+	_attributes._xorigin = values[3];
+	_attributes._yorigin = values[4];
+	_attributes._zorigin = values[5];
+	for (int i = 0; i < 3; i++) {
+		_attributes._xaxis[i] = values[6+i];
+		_attributes._yaxis[i] = values[9+i];
+		_attributes._zaxis[i] = values[12+i];
+	}
+	if (version >= 2) {
+		_attributes._dt = values[15];
+		_attributes._torigin = values[16];
+		_attributes._smat = Matrix(4, 4);
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 4; c++) _attributes._smat.Put(r, c, values[17 + 4*r + c]);
+		}
+	}
+
+	_labels.resize(maps);
+	for (int k = 0; k < maps; k++) {
+		int32_t label;
+		memcpy(&label, ptr, sizeof(label));
+		ptr += sizeof(label);
+		_labels[k] = label;
+	}
+
+	if (offset + maps * NumberOfVoxels(_attributes) * sizeof(float) > _mapped_bytes) {
+		std::cerr << "ProbabilityMapsFile::Read: File is truncated: " << filename << std::endl;
+		exit(1);
+	}
+	_maps = reinterpret_cast<const float *>(static_cast<const char *>(_mapped) + offset);
+}
+
+void ProbabilityMapsFile::Create(const char *filename, const ImageAttributes &attributes, const Array<int> &labels){
+	Close();
+
+	_output = fopen(filename, "wb");
+	if (_output == NULL) {
+		std::cerr << "ProbabilityMapsFile::Create: Cannot open " << filename << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	_attributes = attributes;
+	_attributes._t = 1;
+	_labels = labels;
+	_written = 0;
+
+	const uint32_t version = PMapsVersion, reserved = 0;
+	const int32_t maps = static_cast<int32_t>(labels.size());
+	const int32_t x = _attributes._x, y = _attributes._y, z = _attributes._z;
+	double values[33] = {
+		_attributes._dx, _attributes._dy, _attributes._dz,
+		_attributes._xorigin, _attributes._yorigin, _attributes._zorigin,
+		_attributes._xaxis[0], _attributes._xaxis[1], _attributes._xaxis[2],
+		_attributes._yaxis[0], _attributes._yaxis[1], _attributes._yaxis[2],
+		_attributes._zaxis[0], _attributes._zaxis[1], _attributes._zaxis[2],
+		_attributes._dt, _attributes._torigin
+	};
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < 4; c++) {
+			const bool stored = (_attributes._smat.Rows() == 4 && _attributes._smat.Cols() == 4);
+			values[17 + 4*r + c] = stored ? _attributes._smat.Get(r, c) : (r == c ? 1. : 0.);
+		}
+	}
+	const size_t header = PMapsHeaderSize(PMapsVersion) + maps * sizeof(int32_t);
+	const uint64_t offset = (header + PMapsAlignment - 1) / PMapsAlignment * PMapsAlignment;
+
+	fwrite(PMapsMagic, sizeof(PMapsMagic), 1, _output);
+	fwrite(&version,   sizeof(version),    1, _output);
+	fwrite(&reserved,  sizeof(reserved),   1, _output);
+	fwrite(&maps,      sizeof(maps),       1, _output);
+	fwrite(&x,         sizeof(x),          1, _output);
+	fwrite(&y,         sizeof(y),          1, _output);
+	fwrite(&z,         sizeof(z),          1, _output);
+	fwrite(values,     sizeof(values),     1, _output);
+	fwrite(&offset,    sizeof(offset),     1, _output);
+	for (int k = 0; k < maps; k++) {
+		const int32_t label = labels[k];
+		fwrite(&label, sizeof(label), 1, _output);
+	}
+	Array<char> padding(offset - header, 0);
+	if (!padding.empty()) fwrite(padding.data(), 1, padding.size(), _output);
+}
+
+void ProbabilityMapsFile::WriteMap(const float *values){
+	if (_output == NULL || _written >= GetNumberOfMaps()) {
+		std::cerr << "ProbabilityMapsFile::WriteMap: No more maps in the file" << std::endl;
+		exit(1);
+	}
+	const size_t n = NumberOfVoxels(_attributes);
+	if (fwrite(values, sizeof(float), n, _output) != n) {
+		std::cerr << "ProbabilityMapsFile::WriteMap: Cannot write map " << _written << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	_written++;
+}
+
+void ProbabilityMapsFile::WriteMap(const RealImage &image){
+	const size_t n = NumberOfVoxels(_attributes);
+	if (static_cast<size_t>(image.GetNumberOfVoxels()) != n) {
+		std::cerr << "ProbabilityMapsFile::WriteMap: Image size mismatch" << std::endl;
+		exit(1);
+	}
+	Array<float> values(n);
+	const RealPixel *ptr = image.GetPointerToVoxels();
+	for (size_t i = 0; i < n; i++) values[i] = static_cast<float>(ptr[i]);
+	WriteMap(values.data());
+}
+
+void ProbabilityMapsFile::Close(){
+	if (_mapped) munmap(_mapped, _mapped_bytes);
+	_mapped = NULL;
+	_mapped_bytes = 0;
+	_maps = NULL;
+	if (_output) {
+		const bool complete = (_written == GetNumberOfMaps());
+		if (fclose(_output) != 0 || !complete) {
+			std::cerr << "ProbabilityMapsFile::Close: Incomplete file, " << _written << " of " << GetNumberOfMaps() << " maps written" << std::endl;
+			exit(1);
+		}
+	}
+	_output = NULL;
+	_written = 0;
+}
+
+const float *ProbabilityMapsFile::GetMap(int k) const{
+	if (_maps == NULL || k < 0 || k >= GetNumberOfMaps()) {
+		std::cerr << "ProbabilityMapsFile::GetMap: No such map " << k << std::endl;
+		exit(1);
+	}
+	return _maps + static_cast<size_t>(k) * NumberOfVoxels(_attributes);
+}
+
+RealImage ProbabilityMapsFile::GetImage(int k) const{
+	const float *map = GetMap(k);
+	RealImage image(_attributes);
+	RealPixel *ptr = image.GetPointerToVoxels();
+	const size_t n = NumberOfVoxels(_attributes);
+	for (size_t i = 0; i < n; i++) ptr[i] = map[i];
+	return image;
+}
+
+void ProbabilityMapsFile::ReadImages(char **filenames, int n, std::function<void(int, RealImage &)> add, int batch) const{
+	if (batch <= 0) batch = (tbb_no_threads > 0) ? tbb_no_threads : static_cast<int>(std::thread::hardware_concurrency());
+	if (batch <= 0) batch = 1;
+
+	Array<RealImage> images(min(batch, n));
+	ReadImagesBody body;
+	body._file = this;
+	body._filenames = filenames;
+	body._images = images.data();
+	for (int first = 0; first < n; first += batch) {
+		const int count = min(batch, n - first);
+		body._first = first;
+		parallel_for(blocked_range<int>(0, count, 1), body);
+		for (int i = 0; i < count; i++) {
+			add(first + i, images[i]);
+			images[i].Clear();
+		}
+	}
+}
+
+}
@@ -25,7 +25,9 @@
 #include "mirtk/GenericImage.h"
 
 #include "mirtk/PolynomialBiasField.h"
+#include "mirtk/BSplineBiasField.h"
 #include "mirtk/DrawEM.h"
+#include "mirtk/ProbabilityMapsFile.h"
 #include "mirtk/Matrix.h"
 
 #include <iostream>
@@ -34,6 +36,7 @@
 #include <vector>
 #include <string>
 #include <ctime>
+#include <chrono>
 
 using namespace mirtk;
 using namespace std;
@@ -48,20 +51,36 @@ void PrintHelp(const char *name)
 {
 	std::cout << std::endl;
 	std::cout << "Usage: " << name << " <input> <N> <prob1> .. <probN> <output> [options]" << std::endl;
+	std::cout << "       " << name << " <input> <N> <probs.pmaps> <output> [options]" << std::endl;
 	std::cout << std::endl;
 	std::cout << "Description:" << std::endl;
     std::cout << "  Runs the DrawEM segmentation at the input image with the provided N probability maps of structures. " << std::endl;
 	std::cout << "  The main algorithm is outlined in [1]. " << std::endl;
+	std::cout << "  The N probability maps can also be given as a single probability maps file (.pmaps). " << std::endl;
 	std::cout << std::endl;
 
 	std::cout << "Input options:" << std::endl;
 	std::cout << "GENERAL EM PARAMETERS:" << std::endl;
 	std::cout << " -biasfielddegree <number>       polynomial degree (of one dimension) of biasfield (default = 4)" << std::endl;
+	std::cout << " -biasstride <number>            fit the biasfield to every <number>-th voxel (default = 3)" << std::endl;
+	std::cout << " -biasmodel <model>              model of the biasfield: poly (polynomial, default), bspline or none (no bias correction)" << std::endl;
+	std::cout << " -biasspacing <dx> <dy> <dz>     control point spacing in mm of the bspline biasfield (default: 50 50 50)" << std::endl;
 	std::cout << " -mask <mask>                    mask image" << std::endl;
     std::cout << " -padding <number>               padding value (default is min intensity)" << std::endl;
     std::cout << " -iterations <number>            max number of iterations (default: 20)" << std::endl;
 	std::cout << " -reldiff <double>               min relative difference that assumes convergence" << std::endl;
     std::cout << " -pv <class1> <class2>           add partial volume class between class class1 and class2" << std::endl;
+	std::cout << " -dense                          store priors and posteriors densely inside the mask (faster, uses more memory for large masks)" << std::endl;
+	std::cout << " -sparse <epsilon>               store per voxel only the structures with prior probability above epsilon (dense once the Hui PV correction runs)" << std::endl;
+	std::cout << " -checkpoint <file>              write the state of the segmentation to file during the iterations" << std::endl;
+	std::cout << " -checkpointevery <number>       write the checkpoint every number of iterations (default: 1)" << std::endl;
+	std::cout << " -resume <file>                  continue from a checkpoint written with the same input, atlases and options" << std::endl;
+	std::cout << " -scratch <directory>            keep priors and posteriors inside the mask in memory-mapped files in directory (for images larger than memory)" << std::endl;
+	std::cout << " -levels <number>                run the bias field iterations first on images downsampled by 2^(number-1) .. 2 (default: 1, full resolution only)" << std::endl;
+	std::cout << " -cachelikelihoods               keep the likelihoods between passes with the same parameters (uses K doubles per masked voxel)" << std::endl;
+	std::cout << " -likelihoodlut                  look up the likelihoods in a table of the distinct intensities instead of evaluating them per voxel" << std::endl;
+	std::cout << " -accelerate                     extrapolate the Gaussian parameters from the last EM iterations (SQUAREM), plain EM if the likelihood decreases, not while the bias field, MRF or PV correction is updated" << std::endl;
+	std::cout << " -fused                          compute the W-step in the E-step pass and the M-step statistics in the pass that applies the bias field (in the E-step pass without bias correction)" << std::endl;
 	std::cout << std::endl;
 
 	std::cout << "MRF PARAMETERS:" << std::endl;
@@ -69,6 +88,9 @@ void PrintHelp(const char *name)
 	std::cout << " -mrfstrength <double>           MRF strength (default 1) " << std::endl;
     std::cout << " -bigmrf                         use 26-connectivity in the MRF neighborhood (default no)" << std::endl;
     std::cout << " -mrftimes <number>              max number of times mrf will be performed (default == number of max iterations)" << std::endl;
+    std::cout << " -mrfupdate <mode>               update order of the MRF: sequential (in place, default), jacobi or redblack (both parallel and deterministic)" << std::endl;
+    std::cout << " -activeset <double>             only update voxels whose posteriors or MRF neighbours changed by more than the tolerance in the last MRF step (default 0: all voxels)" << std::endl;
+    std::cout << " -fullsweep <number>             with -activeset, update all voxels every number-th MRF step (default 5, 0: only the first)" << std::endl;
 	std::cout << std::endl;
 
 	std::cout << "RELAXATION PARAMETERS:" << std::endl;
@@ -92,9 +114,10 @@ void PrintHelp(const char *name)
 	std::cout << " -corrected <file>                save corrected image" << std::endl;
 	std::cout << " -savepv <file>                   save segmentation with pvs" << std::endl;
 	std::cout << " -saveprob <number> <file>        save posterior probability of tissue to file"<<std::endl;
+	std::cout << " -saveprobsfile <file>            save posterior probability of the N tissues to a single probability maps file (.pmaps)"<<std::endl;
 	std::cout << " -biasfield <file>                save final bias field (for log transformed intensities) to file. " << std::endl;
     std::cout << std::endl;
-    PrintStandardOptions(std::cout);
+    PrintCommonOptions(std::cout);
     std::cout << std::endl;
 
 	std::cout << "References:" << std::endl;
@@ -126,6 +149,82 @@ void readConnectivityMatrix( Matrix* mat, char* filename)
     from.close();
 }
 
+/// models of the bias field
+enum BiasModel { PolynomialBias, BSplineBias, NoBias };
+
+/// creates the bias field of the model, NULL without bias correction; the bspline lattice
+/// spans the full resolution image so that the same field is used at all levels
+BiasField *newBiasField(BiasModel model, const RealImage &image, int degree, int stride, const double spacing[3])
+{
+	switch (model) {
+	case PolynomialBias:
+		return new PolynomialBiasField(image, degree, stride);
+	case BSplineBias:
+		return new BSplineBiasField(image, spacing[0], spacing[1], spacing[2]);
+	default:
+		return NULL;
+	}
+}
+
+/// whether the bias field has another step of the ramp before the final model: the next
+/// polynomial degree, or switching on the bspline fit
+bool biasFieldRamps(BiasModel model, int degree, int max_degree, bool updating)
+{
+	if (model == PolynomialBias) return degree < max_degree;
+	if (model == BSplineBias) return !updating;
+	return false;
+}
+
+/// downsamples the image by averaging blocks of factor^3 voxels, with padding the padded voxels
+/// are left out and blocks with less than half of the voxels unpadded are padded
+template <class VoxelType>
+RealImage downsampleImage(const GenericImage<VoxelType> &image, int factor, bool use_padding, double padding)
+{
+	ImageAttributes attr = image.Attributes();
+	const int fx = factor;
+	const int fy = attr._y > 1 ? factor : 1;
+	const int fz = attr._z > 1 ? factor : 1;
+	attr._x = (attr._x + fx - 1) / fx;
+	attr._y = (attr._y + fy - 1) / fy;
+	attr._z = (attr._z + fz - 1) / fz;
+	attr._dx *= fx;
+	attr._dy *= fy;
+	attr._dz *= fz;
+
+	// the centre of the coarse lattice in voxel coordinates of the image
+	double x = (attr._x * fx - 1) / 2.0;
+	double y = (attr._y * fy - 1) / 2.0;
+	double z = (attr._z * fz - 1) / 2.0;
+	image.ImageToWorld(x, y, z);
+	attr._xorigin = x;
+	attr._yorigin = y;
+	attr._zorigin = z;
+
+	RealImage coarse(attr);
+	for (int k = 0; k < coarse.GetZ(); ++k) {
+		for (int j = 0; j < coarse.GetY(); ++j) {
+			for (int i = 0; i < coarse.GetX(); ++i) {
+				double sum = 0;
+				int count = 0, total = 0;
+				for (int kk = k * fz; kk < min((k + 1) * fz, image.GetZ()); ++kk) {
+					for (int jj = j * fy; jj < min((j + 1) * fy, image.GetY()); ++jj) {
+						for (int ii = i * fx; ii < min((i + 1) * fx, image.GetX()); ++ii) {
+							const double value = image.Get(ii, jj, kk);
+							total++;
+							if (use_padding && value == padding) continue;
+							sum += value;
+							count++;
+						}
+					}
+				}
+				if (use_padding && 2 * count < total) coarse.Put(i, j, k, padding);
+				else coarse.Put(i, j, k, sum / count);
+			}
+		}
+	}
+	return coarse;
+}
+
 
 
 int main(int argc, char **argv)
@@ -134,7 +233,8 @@ int main(int argc, char **argv)
 	InitializeIOLibrary();
 	int a=1;
 
-	clock_t begin = clock();
+	// wall-clock time, as the atlas loading time
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 	char *output_segmentation, *output_biascorrection, *output_biasfield, *connections, *output_pvsegmentation, *mask;
 	int no_mrf_correction = 1;
         bool relax = false;
@@ -142,6 +242,9 @@ int main(int argc, char **argv)
 	vector<int> hpv;
 	int i, n, padding, maxIterations;
 	int biasfield_degree = 4;
+	int biasstride = 3;
+	BiasModel biasmodel = PolynomialBias;
+	double biasspacing[3] = { 50, 50, 50 };
 	output_biasfield = NULL;
 	connections = NULL;
 	output_pvsegmentation = NULL;
@@ -158,11 +261,21 @@ int main(int argc, char **argv)
 	n = atoi(POSARG(a++));
 	std::cout<<n<<" atlases"<<std::endl;
 
-	// Probabilistic atlas
+	// Probabilistic atlas, N images or a single probability maps file
+	ProbabilityMapsFile atlas_file;
 	char **atlas_names=new char*[n];
-	for (i = 0; i < n; i++) {
-		atlas_names[i] = POSARG(a++);
-        }
+	if (ProbabilityMapsFile::IsProbabilityMapsFile(POSARG(a))) {
+		for (i = 0; i < n; i++) atlas_names[i] = POSARG(a);
+		atlas_file.Read(POSARG(a++));
+		if (atlas_file.GetNumberOfMaps() != n) {
+			std::cerr << "Number of maps in " << atlas_names[0] << " (" << atlas_file.GetNumberOfMaps() << ") does not match N = " << n << std::endl;
+			exit(1);
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			atlas_names[i] = POSARG(a++);
+		}
+	}
 
 	// File name for segmentation
 	output_segmentation = POSARG(a);
@@ -179,11 +292,25 @@ int main(int argc, char **argv)
     double reldiff=0.005;
 	bool bignn=false,hui=false,superlbls=false;
 	bool postpen=false,settissues=false;
+	bool dense=false;
+	double sparse=-1;
+	bool cachelikelihoods=false;
+	bool likelihoodtable=false;
+	bool fused=false;
+	bool accelerate=false;
+	int levels=1;
+	char *checkpoint=NULL, *resume=NULL;
+	char *scratch=NULL;
+	int checkpointevery=1;
+	DrawEM::MRFUpdate mrfupdate=DrawEM::MRFSequential;
+	double activeset=0;
+	int fullsweep=5;
 	RealImage postpenalty;
 	int *tissuelabels, *superlabels;
 	int ss=0;
 	vector<string> savesegs;
 	vector<int> savesegsnr;
+	char *probsfile=NULL;
     char *output_pv=NULL;
 
 
@@ -230,6 +357,28 @@ int main(int argc, char **argv)
 			biasfield_degree=atoi(ARGUMENT);
 			std::cout << "Degree of biasfield polynomial: " << biasfield_degree << std::endl;
 		}
+		else if (OPTION("-biasstride")){
+			biasstride=atoi(ARGUMENT);
+		}
+		else if (OPTION("-biasmodel")){
+			const char *model = ARGUMENT;
+			if      (strcmp(model, "poly") == 0)    biasmodel=PolynomialBias;
+			else if (strcmp(model, "bspline") == 0) biasmodel=BSplineBias;
+			else if (strcmp(model, "none") == 0)    biasmodel=NoBias;
+			else {
+				std::cerr << "Unknown bias model: " << model << std::endl;
+				exit(1);
+			}
+		}
+		else if (OPTION("-biasspacing")){
+			biasspacing[0]=atof(ARGUMENT);
+			biasspacing[1]=atof(ARGUMENT);
+			biasspacing[2]=atof(ARGUMENT);
+			if (biasspacing[0] <= 0 || biasspacing[1] <= 0 || biasspacing[2] <= 0) {
+				std::cerr << "Control point spacing of the bias field must be positive" << std::endl;
+				exit(1);
+			}
+		}
 		else if (OPTION("-biasfield")){
 			output_biasfield=ARGUMENT;
 			std::cout << "Output biasfield to: " << output_biasfield << std::endl;
@@ -263,6 +412,9 @@ int main(int argc, char **argv)
 			}
 			ss=n;
 		}
+		else if (OPTION("-saveprobsfile")) {
+			probsfile = ARGUMENT;
+		}
 		else if (OPTION("-saveprob")) {
 			savesegsnr.push_back(atoi(ARGUMENT));
 			savesegs.push_back(ARGUMENT);
@@ -274,6 +426,22 @@ int main(int argc, char **argv)
         else if (OPTION("-bigmrf")){
 			bignn=true;
 		}
+		else if (OPTION("-mrfupdate")){
+			const char *mode = ARGUMENT;
+			if      (strcmp(mode, "sequential") == 0) mrfupdate=DrawEM::MRFSequential;
+			else if (strcmp(mode, "jacobi") == 0)     mrfupdate=DrawEM::MRFJacobi;
+			else if (strcmp(mode, "redblack") == 0)   mrfupdate=DrawEM::MRFRedBlack;
+			else {
+				std::cerr << "Unknown MRF update mode: " << mode << std::endl;
+				exit(1);
+			}
+		}
+		else if (OPTION("-activeset")){
+			activeset=atof(ARGUMENT);
+		}
+		else if (OPTION("-fullsweep")){
+			fullsweep=atoi(ARGUMENT);
+		}
 		else if (OPTION("-mrftimes")){
 			mrftimes=atoi(ARGUMENT);
 			mrfdecl=true;
@@ -281,6 +449,47 @@ int main(int argc, char **argv)
 		else if (OPTION("-hui")){
 			hui=true;
 		}
+		else if (OPTION("-dense")){
+			dense=true;
+		}
+		else if (OPTION("-sparse")){
+			sparse=atof(ARGUMENT);
+		}
+		else if (OPTION("-cachelikelihoods")){
+			cachelikelihoods=true;
+		}
+		else if (OPTION("-likelihoodlut")){
+			likelihoodtable=true;
+		}
+		else if (OPTION("-fused")){
+			fused=true;
+		}
+		else if (OPTION("-accelerate")){
+			accelerate=true;
+		}
+		else if (OPTION("-checkpoint")){
+			checkpoint=ARGUMENT;
+		}
+		else if (OPTION("-checkpointevery")){
+			checkpointevery=atoi(ARGUMENT);
+			if (checkpointevery < 1) {
+				std::cerr << "Checkpoint interval must be at least 1" << std::endl;
+				exit(1);
+			}
+		}
+		else if (OPTION("-resume")){
+			resume=ARGUMENT;
+		}
+		else if (OPTION("-scratch")){
+			scratch=ARGUMENT;
+		}
+		else if (OPTION("-levels")){
+			levels=atoi(ARGUMENT);
+			if (levels < 1) {
+				std::cerr << "Number of levels must be at least 1" << std::endl;
+				exit(1);
+			}
+		}
 		else if (OPTION("-tissues")){
 			tissuelabels=new int[n];
 			for(int i=0;i<n;i++)tissuelabels[i]=0;
@@ -307,7 +516,7 @@ int main(int argc, char **argv)
 				superlabels[atoi(ARGUMENT)]=superlbl;
 			}
 		}
-		else HANDLE_STANDARD_OR_UNKNOWN_OPTION();
+		else HANDLE_COMMON_OR_UNKNOWN_OPTION();
 	}
 
 
@@ -351,16 +560,17 @@ int main(int argc, char **argv)
     }
 
 
-    // Create classification object
-    std::cout<<"initialize segmentation"<<std::endl;
-    DrawEM *classification = new DrawEM();
-	double atlasmin, atlasmax;
-	for (i = 0; i < n; i++) {
-		std::cout << "Image " << i <<" = " << atlas_names[i];
-		RealImage atlas(atlas_names[i]);
-		classification->addProbabilityMap(atlas);
-		atlas.GetMinMaxAsDouble(&atlasmin, &atlasmax);
-		std::cout << " with range: "<<  atlasmin <<" - "<<atlasmax<<std::endl;
+	ByteImage maskByteImage;
+	if ( mask != NULL ){
+		RealImage maskImage(mask);
+		maskByteImage.Initialize(maskImage.Attributes());
+		RealPixel* ptr = maskImage.GetPointerToVoxels();
+		BytePixel* bptr = maskByteImage.GetPointerToVoxels();
+		for( int i = 0; i < maskImage.GetNumberOfVoxels(); ++i ){
+			if( *ptr > 0 ) *bptr = 1;
+			else *bptr = 0;
+			ptr++; bptr++;
+		}
 	}
 
 	Matrix* G;
@@ -374,26 +584,129 @@ int main(int argc, char **argv)
 		no_mrf_correction = 1;
 		G = new Matrix(1,1);
 	}
+
+	// a resumed run continues at full resolution
+	if (resume != NULL) levels = 1;
+
+	// coarse-to-fine: the iterations of the bias field degree ramp run on downsampled images,
+	// the full resolution starts from the Gaussian parameters and bias field of the finest of these
+	int curr_biasfield_degree = 1;
+	BiasField *biasfield = NULL;
+	bool BFupdate = false;
+	bool ramped = false;
+	Array<double> parameters;
+	// wall-clock time spent loading the priors (CPU time would add up the loading threads)
+	double loading_secs = 0;
+	std::chrono::steady_clock::time_point loading_begin;
+	for (int level = levels-1; level > 0; level--) {
+		const int factor = 1 << level;
+		std::cout << "level " << level << ": downsampling by " << factor << std::endl;
+		RealImage coarseImage = downsampleImage(image, factor, true, padding);
+
+		DrawEM coarse;
+		loading_begin = std::chrono::steady_clock::now();
+		atlas_file.ReadImages(atlas_names, n, [&](int i, RealImage &atlas) {
+			coarse.addProbabilityMap(downsampleImage(atlas, factor, false, 0));
+		});
+		loading_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - loading_begin).count();
+		coarse.SetInput(coarseImage, *G);
+		if(superlbls)coarse.setSuperlabels(superlabels);
+		if(dense)coarse.SetDenseStorage(dense);
+		if(sparse>=0)coarse.SetSparseStorage(sparse);
+		if(cachelikelihoods)coarse.SetLikelihoodCache(cachelikelihoods);
+		if(likelihoodtable)coarse.SetLikelihoodTable(likelihoodtable);
+		if(fused)coarse.SetFusedIteration(fused);
+		if(accelerate)coarse.SetAcceleration(accelerate);
+		coarse.SetPadding(padding);
+		if ( mask != NULL ){
+			RealImage coarseMask = downsampleImage(maskByteImage, factor, false, 0);
+			ByteImage coarseByteMask(coarseMask.Attributes());
+			for( int i = 0; i < coarseMask.GetNumberOfVoxels(); ++i ){
+				coarseByteMask.GetPointerToVoxels()[i] = (coarseMask.GetPointerToVoxels()[i] >= 0.5);
+			}
+			coarse.SetMask(coarseByteMask);
+		}
+		coarse.Initialise();
+
+		if (parameters.empty()) {
+			biasfield = newBiasField(biasmodel, image, curr_biasfield_degree, biasstride, biasspacing);
+			coarse.SetBiasField(biasfield);
+		} else {
+			coarse.SetParameters(parameters);
+			coarse.SetBiasField(biasfield);
+			if (biasfield) coarse.ApplyBiasField();
+		}
+
+		// as phase 0 at full resolution, until converged with the final degree
+		int iterations = 0, number_current_iterations = 0;
+		ramped = false;
+		while( !ramped && iterations < maxIterations ){
+			double rel_diff = coarse.IterateSegmentation(false, false, BFupdate, !BFupdate);
+			iterations++;
+
+			if( rel_diff < reldiff ){
+				if( biasFieldRamps(biasmodel, curr_biasfield_degree, biasfield_degree, BFupdate) && number_current_iterations ){
+					if (biasmodel == PolynomialBias) {
+						curr_biasfield_degree++;
+						delete biasfield;
+						biasfield = newBiasField(biasmodel, image, curr_biasfield_degree, biasstride, biasspacing);
+						coarse.SetBiasField(biasfield);
+					}
+					BFupdate = true;
+				}else{
+					ramped = true;
+				}
+				// the objective changed, or the level ends
+				coarse.ResetAcceleration();
+				number_current_iterations = 0;
+			}else{
+				number_current_iterations++;
+			}
+		}
+		coarse.ResetAcceleration();
+		coarse.GetParameters(parameters);
+	}
+
+    // Create classification object
+    std::cout<<"initialize segmentation"<<std::endl;
+    DrawEM *classification = new DrawEM();
+	double atlasmin, atlasmax;
+	loading_begin = std::chrono::steady_clock::now();
+	if (atlas_file.GetNumberOfMaps() > 0) {
+		// hashed straight from the mapped file
+		std::cout << "Images 0 - " << n-1 << " = " << atlas_names[0] << std::endl;
+		classification->addProbabilityMaps(atlas_file);
+	} else {
+		atlas_file.ReadImages(atlas_names, n, [&](int i, RealImage &atlas) {
+			std::cout << "Image " << i <<" = " << atlas_names[i];
+			classification->addProbabilityMap(atlas);
+			atlas.GetMinMaxAsDouble(&atlasmin, &atlasmax);
+			std::cout << " with range: "<<  atlasmin <<" - "<<atlasmax<<std::endl;
+		});
+	}
+	loading_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - loading_begin).count();
+	std::cout<<"atlas loading time: "<<loading_secs<<" sec"<<std::endl;
+
 	classification->SetInput(image, *G);
 
 	if(bignn)classification->setbignn(bignn);
+	classification->setMRFUpdate(mrfupdate);
+	if(activeset>0)classification->setMRFActiveSet(activeset, fullsweep);
 	if(superlbls)classification->setSuperlabels(superlabels);
 	if(settissues)	classification->setTissueLabels(n,tissuelabels);
     else if(hui){ std::cerr<<"need to set tissues for pv correction"<<std::endl; PrintHelp(EXECNAME); exit(1);}
 	if(hui)	classification->setHui(hui);
 	if(mrfstrength!=1)classification->setMRFstrength(mrfstrength);
+	if(dense)classification->SetDenseStorage(dense);
+	if(sparse>=0)classification->SetSparseStorage(sparse);
+	if(scratch)classification->SetScratchDirectory(scratch);
+	if(cachelikelihoods)classification->SetLikelihoodCache(cachelikelihoods);
+	if(likelihoodtable)classification->SetLikelihoodTable(likelihoodtable);
+	if(fused)classification->SetFusedIteration(fused);
+	if(accelerate)classification->SetAcceleration(accelerate);
 
     classification->SetPadding(padding);
 	if ( mask != NULL ){
-		RealImage maskImage(mask);
-		ByteImage maskByteImage(maskImage.Attributes());
-		RealPixel* ptr = maskImage.GetPointerToVoxels();
-		BytePixel* bptr = maskByteImage.GetPointerToVoxels();
-		for( int i = 0; i < maskImage.GetNumberOfVoxels(); ++i ){
-			if( *ptr > 0 ) *bptr = 1;
-			else *bptr = 0;
-			ptr++; bptr++;
-		}
 		classification->SetMask(maskByteImage);
     }
     classification->Initialise();
@@ -403,15 +716,22 @@ int main(int argc, char **argv)
 
 	double rel_diff = 1.0;
 	bool stop = false;
-	int curr_biasfield_degree = 1;
 	int iter = 0;
     int improvePhase = 0;
 
 	// Create bias field
-	PolynomialBiasField *biasfield = new PolynomialBiasField(image, curr_biasfield_degree);
-	classification->SetBiasField(biasfield);
+	if (parameters.empty()) {
+		biasfield = newBiasField(biasmodel, image, curr_biasfield_degree, biasstride, biasspacing);
+		classification->SetBiasField(biasfield);
+	} else {
+		// warm start from the coarsest levels
+		classification->SetParameters(parameters);
+		classification->SetBiasField(biasfield);
+		if (biasfield) classification->ApplyBiasField();
+		classification->Print();
+		if (ramped) improvePhase = 1;
+	}
 
-	bool BFupdate = false;
 	bool MRFupdate = false;
 	vector<int> pv_positions;
 	int number_current_iterations = 0;
@@ -419,28 +739,42 @@ int main(int argc, char **argv)
 	bool relaxed = false;
 	int modlabel=1;
 
-
-    while( !stop && iter < maxIterations ){
-
-		if( !MRFupdate || mrftimes<=0)
-			classification->EStep();
-		else{
-			classification->EStepMRF();	
-			mrftimes--;
+	if (resume != NULL) {
+		// continue with the iteration and phase of the checkpoint
+		Array<int> state;
+		DrawEM::ReadCheckpointState(resume, state);
+		if (state.size() != 10) {
+			std::cerr << "Checkpoint " << resume << " was not written by draw-em" << std::endl;
+			exit(1);
 		}
+		iter = state[0];
+		improvePhase = state[1];
+		curr_biasfield_degree = state[2];
+		BFupdate = state[3];
+		MRFupdate = state[4];
+		mrftimes = state[5];
+		relaxtimes = state[6];
+		relaxed = state[7];
+		PVon = state[8];
+		number_current_iterations = state[9];
+
+		delete biasfield;
+		biasfield = newBiasField(biasmodel, image, curr_biasfield_degree, biasstride, biasspacing);
+		classification->SetBiasField(biasfield);
+		std::cout << "resuming from " << resume << " at iteration " << iter << std::endl;
+		classification->ReadCheckpoint(resume);
+		if (postpen && improvePhase > 1) classification->setPostPenalty(postpenalty);
+		classification->Print();
+	}
 
+    while( !stop && iter < maxIterations ){
 
-		if(hui && iter%2==modlabel)
-			classification->huiPVCorrection();
-
-		if( BFupdate ) {
-			classification->WStep();
-            classification->BStep();
-		}
-		classification->MStep();
+		bool mrf = MRFupdate && mrftimes>0;
+		if(mrf) mrftimes--;
 
-		classification->Print();
-		rel_diff = classification->LogLikelihood();
+		// a fall back restores only the Gaussian parameters, see Accelerate
+		bool extrapolate = !BFupdate && !hui && !(MRFupdate && mrftimes>0);
+		rel_diff = classification->IterateSegmentation(mrf, hui && iter%2==modlabel, BFupdate, extrapolate);
 
 
         if( rel_diff < reldiff && iter < maxIterations ){
@@ -448,14 +782,16 @@ int main(int argc, char **argv)
             switch( improvePhase ){
 			case 0:
 				//gradually increase the biasfield_degree until desired
-                if( curr_biasfield_degree < biasfield_degree && number_current_iterations){
-					curr_biasfield_degree++;
-					delete biasfield;
-					biasfield = new PolynomialBiasField(image, curr_biasfield_degree);
-					classification->SetBiasField(biasfield);
+                if( biasFieldRamps(biasmodel, curr_biasfield_degree, biasfield_degree, BFupdate) && number_current_iterations){
+					if (biasmodel == PolynomialBias) {
+						curr_biasfield_degree++;
+						delete biasfield;
+						biasfield = newBiasField(biasmodel, image, curr_biasfield_degree, biasstride, biasspacing);
+						classification->SetBiasField(biasfield);
+					}
 
 					BFupdate = true;
-                    if( curr_biasfield_degree == biasfield_degree ){
+                    if( !biasFieldRamps(biasmodel, curr_biasfield_degree, biasfield_degree, BFupdate) ){
 						improvePhase++;
 					}
 					break;
@@ -519,6 +855,8 @@ int main(int argc, char **argv)
 				stop = true;
 				break;
 			}
+			// each phase changes the objective (bias field, priors, MRF, classes)
+			classification->ResetAcceleration();
 			number_current_iterations = 0;
 
         }else{
@@ -526,8 +864,26 @@ int main(int argc, char **argv)
 		}
 
 		iter++;
+
+		if( checkpoint != NULL && !stop && iter % checkpointevery == 0 ){
+			Array<int> state(10);
+			state[0] = iter;
+			state[1] = improvePhase;
+			state[2] = curr_biasfield_degree;
+			state[3] = BFupdate;
+			state[4] = MRFupdate;
+			state[5] = mrftimes;
+			state[6] = relaxtimes;
+			state[7] = relaxed;
+			state[8] = PVon;
+			state[9] = number_current_iterations;
+			std::cout << "writing checkpoint to " << checkpoint << std::endl;
+			classification->WriteCheckpoint(checkpoint, state);
+		}
 	}
 
+	// the results are written from evaluated parameters
+	classification->ResetAcceleration();
 	if(hui )classification->huiPVCorrection(true);
 
 
@@ -570,16 +926,22 @@ int main(int argc, char **argv)
 		std::cout<<"saving probability map of structure "<<savesegsnr[i]<<" to "<<savesegs[i]<<std::endl;
 		classification->WriteProbMap(savesegsnr[i],savesegs[i].c_str());
 	}
+	if (probsfile != NULL) {
+		Array<int> labels;
+		for (int i = 0; i < n; ++i) labels.push_back((atlas_file.GetNumberOfMaps() > 0) ? atlas_file.GetLabel(i) : i);
+		std::cout<<"saving probability maps of structures to "<<probsfile<<std::endl;
+		classification->WriteProbMaps(probsfile, labels);
+	}
 
 	delete G;
 	delete classification;
 
 
-	clock_t end = clock();
-	int elapsed_secs = round( double(end - begin) / CLOCKS_PER_SEC);
+	int elapsed_secs = round(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
 	int elapsed_mins = round(elapsed_secs/60);
 	elapsed_secs = round(elapsed_secs%60);
 	std::cout<<"elapsed time: "<<elapsed_mins<<" min "<<elapsed_secs<<" sec"<<std::endl;
+	std::cout<<"atlas loading time: "<<round(loading_secs)<<" sec"<<std::endl;
 
 	return 0;
 }
@@ -0,0 +1,162 @@
+/*
+ * Developing brain Region Annotation With Expectation-Maximization (Draw-EM)
+ *
+ * Copyright 2013-2020 Imperial College London
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mirtk/Common.h"
+#include "mirtk/Options.h"
+
+#include "mirtk/IOConfig.h"
+#include "mirtk/GenericImage.h"
+
+#include "mirtk/EMBase.h"
+#include <chrono>
+
+using namespace mirtk;
+using namespace std;
+
+
+// =============================================================================
+// Help
+// =============================================================================
+
+// -----------------------------------------------------------------------------
+void PrintHelp(const char *name)
+{
+	std::cout << std::endl;
+	std::cout << "Usage: " << name << " <input> <N> <prob1> .. <probN> [options]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "Description:" << std::endl;
+	std::cout << "  Runs EM segmentation at the input image with the provided N probability maps of structures," << std::endl;
+	std::cout << "  once with exact likelihoods and once with the likelihood lookup table, and reports the run" << std::endl;
+	std::cout << "  times and the agreement of the two segmentations (overall and Dice overlap per structure)." << std::endl;
+	std::cout << std::endl;
+	std::cout << "Input options:" << std::endl;
+	std::cout << "  -mask <mask>               run EM inside the provided mask" << std::endl;
+	std::cout << "  -padding <number>          run EM where input > padding value" << std::endl;
+	std::cout << "  -iterations <number>       maximum number of iterations (default: 50)" << std::endl;
+	std::cout << std::endl;
+	PrintCommonOptions(std::cout);
+	std::cout << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+double RunEM(const RealImage &image, int n, char **atlas_names, ByteImage *mask, int padding,
+             int iterations, bool table, GenericImage<int> &segmentation)
+{
+	EMBase classification;
+	for (int i = 0; i < n; i++) {
+		RealImage atlas(atlas_names[i]);
+		classification.addProbabilityMap(atlas);
+	}
+	if (mask) classification.SetMask(*mask);
+	classification.SetLikelihoodTable(table);
+	classification.SetPadding(padding);
+	classification.SetInput(image);
+	classification.Initialise();
+
+	// the EM iterations only, reading the atlas is the same in both modes
+	auto start = std::chrono::steady_clock::now();
+	double rel_diff;
+	int i=0;
+	do {
+		std::cout << "Iteration = " << i+1 << " / " << iterations << std::endl;
+		rel_diff = classification.Iterate(i);
+		i++;
+	} while ((rel_diff>0.001)&&(i<iterations));
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	classification.ConstructSegmentation(segmentation);
+	return elapsed.count();
+}
+
+// =============================================================================
+// Main
+// =============================================================================
+
+// -----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	REQUIRES_POSARGS(3);
+	InitializeIOLibrary();
+	int a=1;
+
+	int i, n, padding, iterations;
+
+	// Input image
+	RealImage image;
+	image.Read(POSARG(a++));
+
+	// Number of tissues
+	n = atoi(POSARG(a++));
+
+	// Probabilistic atlas
+	char **atlas_names=new char*[n];
+	for (i = 0; i < n; i++) {
+		atlas_names[i] = POSARG(a++);
+	}
+
+	// Default parameters
+	iterations = 50;
+	padding    = -1;//MIN_GREY;
+	bool usemask = false;
+	ByteImage mask;
+
+	for (ALL_OPTIONS) {
+		if (OPTION("-mask")){
+			usemask = true;
+			mask.Read(ARGUMENT);
+		}
+		else if (OPTION("-padding")){
+			padding=atoi(ARGUMENT);
+		}
+		else if (OPTION("-iterations")){
+			iterations=atoi(ARGUMENT);
+		}
+		else HANDLE_COMMON_OR_UNKNOWN_OPTION();
+	}
+
+	GenericImage<int> exact, table;
+	double exact_time = RunEM(image, n, atlas_names, usemask ? &mask : NULL, padding, iterations, false, exact);
+	double table_time = RunEM(image, n, atlas_names, usemask ? &mask : NULL, padding, iterations, true, table);
+
+	// agreement of the segmentations, labels are 1..N (0 outside of the mask)
+	Array<int> exact_count(n+1, 0), table_count(n+1, 0), both_count(n+1, 0);
+	int labelled = 0, differ = 0;
+	const int *pe = exact.GetPointerToVoxels();
+	const int *pt = table.GetPointerToVoxels();
+	for (i = 0; i < exact.GetNumberOfVoxels(); i++, pe++, pt++) {
+		if (*pe == 0 && *pt == 0) continue;
+		labelled++;
+		if (*pe != *pt) differ++;
+		if (*pe >= 0 && *pe <= n) exact_count[*pe]++;
+		if (*pt >= 0 && *pt <= n) table_count[*pt]++;
+		if (*pe == *pt && *pe >= 0 && *pe <= n) both_count[*pe]++;
+	}
+
+	std::cout << std::endl;
+	std::cout << "exact likelihoods:  " << exact_time << " s" << std::endl;
+	std::cout << "lookup table:       " << table_time << " s" << std::endl;
+	std::cout << "speedup: " << ((table_time > 0) ? exact_time / table_time : 0) << std::endl;
+	std::cout << "voxels with different labels: " << differ << " / " << labelled << std::endl;
+	std::cout << "Dice overlap per structure:" << std::endl;
+	for (i = 0; i <= n; i++) {
+		if (exact_count[i] + table_count[i] == 0) continue;
+		std::cout << "  " << i << ": " << 2.0 * both_count[i] / (exact_count[i] + table_count[i]) << std::endl;
+	}
+
+	delete[] atlas_names;
+	return 0;
+}
@@ -23,6 +23,7 @@
 #include "mirtk/IOConfig.h"
 
 #include "mirtk/HashProbabilisticAtlas.h"
+#include "mirtk/ProbabilityMapsFile.h"
 
 
 using namespace mirtk;
@@ -38,6 +39,7 @@ void PrintHelp(const char *name)
 {
     std::cout << std::endl;
     std::cout << "Usage: " << name << " <N> <atlas1> .. <atlasN> <output> [options]" << std::endl;
+    std::cout << "       " << name << " <N> <atlases.pmaps> <output> [options]" << std::endl;
     std::cout << std::endl;
     std::cout << "Description:" << std::endl;
     std::cout << "  Computes the hard segmentation of the N atlases. " << std::endl;
@@ -47,6 +49,7 @@ void PrintHelp(const char *name)
     std::cout << "  -mrftimes <number>              number of times the mrf term will be applied (default 0)" << std::endl;
     std::cout <<	"  -mrfweight <double>             weight of the mrf term (default 1/3)." << std::endl;
     std::cout <<	"  -posteriors <post1> .. <postN>  write posteriors (useful when MRF is used)." << std::endl;
+    std::cout <<	"  -posteriors <posts.pmaps>       write posteriors to a single probability maps file." << std::endl;
     std::cout << std::endl;
     PrintStandardOptions(std::cout);
     std::cout << std::endl;
@@ -125,15 +128,30 @@ int main(int argc, char **argv){
   // Number of tissues
   n = atoi(POSARG(a++));
 
-  // Read atlas for each tissue
+  // Read atlas for each tissue, from N images or a single probability maps file
+  ProbabilityMapsFile atlas_file;
+  if (ProbabilityMapsFile::IsProbabilityMapsFile(POSARG(a))) {
+    atlas_file.Read(POSARG(a));
+    if (atlas_file.GetNumberOfMaps() != n) {
+      std::cerr << "Number of maps in " << POSARG(a) << " (" << atlas_file.GetNumberOfMaps() << ") does not match N = " << n << std::endl;
+      exit(1);
+    }
+  }
   double min, max;
-  for (int i = 0; i < n; i++) {
-    RealImage image(POSARG(a));
-    std::cerr << "Image " << i <<" = " << POSARG(a);
-    image.GetMinMaxAsDouble(&min, &max);
-    std::cout << " with range: "<<  min <<" - "<<max<<std::endl;
-    atlas.AddImage(image);
+  if (atlas_file.GetNumberOfMaps() > 0) {
+    // hashed straight from the mapped file
+    std::cerr << "Images 0 - " << n-1 << " = " << POSARG(a) << std::endl;
+    atlas.AddMaps(atlas_file);
     a++;
+  } else {
+    for (int i = 0; i < n; i++) {
+      RealImage image(POSARG(a));
+      std::cerr << "Image " << i <<" = " << POSARG(a);
+      image.GetMinMaxAsDouble(&min, &max);
+      std::cout << " with range: "<<  min <<" - "<<max<<std::endl;
+      atlas.AddImage(image);
+      a++;
+    }
   }
 
   // File name for output
@@ -141,6 +159,7 @@ int main(int argc, char **argv){
 
   string *post = new string[n];
   bool saveposts=false;
+  string postsfile;
   int mrftimes=0;
   for (ALL_OPTIONS) {
       if (OPTION("-mrfweight")){
@@ -151,7 +170,9 @@ int main(int argc, char **argv){
       }
       else if (OPTION("-posteriors")) {
           saveposts = true;
-          for (int i = 0; i < n; i++) {
+          post[0] = ARGUMENT;
+          if (ProbabilityMapsFile::IsProbabilityMapsFile(post[0].c_str())) postsfile = post[0];
+          else for (int i = 1; i < n; i++) {
             post[i] = ARGUMENT;
           }
       }
@@ -191,6 +212,12 @@ int main(int argc, char **argv){
 
 
   if(saveposts){
+      ProbabilityMapsFile posts_file;
+      if(!postsfile.empty()){
+          Array<int> labels;
+          for (int i = 0; i < n; i++) labels.push_back((atlas_file.GetNumberOfMaps() > 0) ? atlas_file.GetLabel(i) : i);
+          posts_file.Create(postsfile.c_str(), atlas.GetImage(0).Attributes(), labels);
+      }
       for (int i = 0; i < n; i++){
           RealImage image=atlas.GetImage(i).ToGenericImage();
           if(mrftimes>0){
@@ -201,8 +228,10 @@ int main(int argc, char **argv){
                   ptr++; sptr++;
               }
           }
-          image.Write(post[i].c_str());
+          if(postsfile.empty()) image.Write(post[i].c_str());
+          else posts_file.WriteMap(image);
        }
+      posts_file.Close();
   }
 	  
   delete[] post;
@@ -23,8 +23,10 @@
 #include "mirtk/GenericImage.h"
 
 #include "mirtk/EMBase.h"
+#include "mirtk/ProbabilityMapsFile.h"
 #include <vector>
 #include <sstream>
+#include <chrono>
 
 using namespace mirtk;
 using namespace std;
@@ -39,10 +41,12 @@ void PrintHelp(const char *name)
 {
 	std::cout << std::endl;
 	std::cout << "Usage: " << name << " <input> <N> <prob1> .. <probN> <output> [options]" << std::endl;
+	std::cout << "       " << name << " <input> <N> <probs.pmaps> <output> [options]" << std::endl;
 	std::cout << std::endl;
 	std::cout << "Description:" << std::endl;
 	std::cout << "  Runs EM segmentation at the input image with the provided N probability maps of structures. " << std::endl;
 	std::cout << "  e.g. " << name << " input.nii.gz 5 bg.nii.gz csf.nii.gz gm.nii.gz wm.nii.gz dgm.nii.gz segmentation.nii.gz" << std::endl;
+	std::cout << "  The N probability maps can also be given as a single probability maps file (.pmaps)." << std::endl;
 	std::cout << std::endl;
 	std::cout << "Input options:" << std::endl;
 	std::cout << "  -mask <mask>               run EM inside the provided mask" << std::endl;
@@ -51,8 +55,15 @@ void PrintHelp(const char *name)
 	std::cout << "  -saveprob <number> <file>  save posterior probability of structure with number <number> to file "<<std::endl;
 	std::cout <<	"                             (0-indexed i.e. structure 1 has number 0)"<<std::endl;
 	std::cout << "  -saveprobs <basename>      save posterior probability of structures to files with basename <basename>"<<std::endl;
+	std::cout << "  -saveprobsfile <file>      save posterior probability of structures to a single probability maps file (.pmaps)"<<std::endl;
+	std::cout << "  -dense                     store priors and posteriors densely inside the mask (faster, uses more memory for large masks)"<<std::endl;
+	std::cout << "  -sparse <epsilon>          store per voxel only the structures with prior probability above epsilon"<<std::endl;
+	std::cout << "  -cachelikelihoods          keep the likelihoods between passes with the same parameters (uses K doubles per masked voxel)"<<std::endl;
+	std::cout << "  -likelihoodlut             look up the likelihoods in a table of the distinct intensities instead of evaluating them per voxel"<<std::endl;
+	std::cout << "  -fused                     sum the M-step statistics in the E-step pass over the voxels"<<std::endl;
+	std::cout << "  -accelerate                extrapolate the Gaussian parameters from the last EM iterations (SQUAREM)"<<std::endl;
 	std::cout << std::endl;
-	PrintStandardOptions(std::cout);
+	PrintCommonOptions(std::cout);
 	std::cout << std::endl;
 }
 
@@ -81,10 +92,20 @@ int main(int argc, char **argv)
 	// Number of tissues
 	n = atoi(POSARG(a++));
 
-	// Probabilistic atlas
+	// Probabilistic atlas, N images or a single probability maps file
+	ProbabilityMapsFile atlas_file;
 	char **atlas_names=new char*[n];
-	for (i = 0; i < n; i++) {
-		atlas_names[i] = POSARG(a++);
+	if (ProbabilityMapsFile::IsProbabilityMapsFile(POSARG(a))) {
+		for (i = 0; i < n; i++) atlas_names[i] = POSARG(a);
+		atlas_file.Read(POSARG(a++));
+		if (atlas_file.GetNumberOfMaps() != n) {
+			std::cerr << "Number of maps in " << atlas_names[0] << " (" << atlas_file.GetNumberOfMaps() << ") does not match N = " << n << std::endl;
+			exit(1);
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			atlas_names[i] = POSARG(a++);
+		}
 	}
 	// Probabilistic atlas
 	// File name for output
@@ -94,6 +115,13 @@ int main(int argc, char **argv)
 	iterations = 50;
 	padding    = -1;//MIN_GREY;
 	bool usemask = false;
+	bool dense = false;
+	double sparse = -1;
+	bool cachelikelihoods = false;
+	bool likelihoodtable = false;
+	bool fused = false;
+	bool accelerate = false;
+	const char *probsfile = NULL;
 	ByteImage mask;
 
 	int ss=0;
@@ -111,6 +139,24 @@ int main(int argc, char **argv)
 		else if (OPTION("-iterations")){
 			iterations=atoi(ARGUMENT);
 		}
+		else if (OPTION("-dense")){
+			dense = true;
+		}
+		else if (OPTION("-sparse")){
+			sparse = atof(ARGUMENT);
+		}
+		else if (OPTION("-cachelikelihoods")){
+			cachelikelihoods = true;
+		}
+		else if (OPTION("-likelihoodlut")){
+			likelihoodtable = true;
+		}
+		else if (OPTION("-fused")){
+			fused = true;
+		}
+		else if (OPTION("-accelerate")){
+			accelerate = true;
+		}
 		else if (OPTION("-saveprobs")) {
 			char* probsBase = ARGUMENT;
 			savesegsnr.clear();
@@ -123,24 +169,40 @@ int main(int argc, char **argv)
 			}
 			ss=n;
 		}
+		else if (OPTION("-saveprobsfile")) {
+			probsfile = ARGUMENT;
+		}
 		else if (OPTION("-saveprob")) {
 			savesegsnr.push_back(atoi(ARGUMENT));
 			savesegs.push_back(ARGUMENT);
 			ss++;
 		}
-		else HANDLE_STANDARD_OR_UNKNOWN_OPTION();
+		else HANDLE_COMMON_OR_UNKNOWN_OPTION();
 	}
 
 	EMBase *classification = new EMBase();
 	double atlasmin, atlasmax;
-	for (i = 0; i < n; i++) {
-		std::cout << "Image " << i <<" = " << atlas_names[i];
-		RealImage atlas(atlas_names[i]);
-		classification->addProbabilityMap(atlas);
-		atlas.GetMinMaxAsDouble(&atlasmin, &atlasmax);
-		std::cout << " with range: "<<  atlasmin <<" - "<<atlasmax<<std::endl;
+	std::chrono::steady_clock::time_point loading_begin = std::chrono::steady_clock::now();
+	if (atlas_file.GetNumberOfMaps() > 0) {
+		// hashed straight from the mapped file
+		std::cout << "Images 0 - " << n-1 << " = " << atlas_names[0] << std::endl;
+		classification->addProbabilityMaps(atlas_file);
+	} else {
+		atlas_file.ReadImages(atlas_names, n, [&](int i, RealImage &atlas) {
+			std::cout << "Image " << i <<" = " << atlas_names[i];
+			classification->addProbabilityMap(atlas);
+			atlas.GetMinMaxAsDouble(&atlasmin, &atlasmax);
+			std::cout << " with range: "<<  atlasmin <<" - "<<atlasmax<<std::endl;
+		});
 	}
+	std::cout << "atlas loading time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - loading_begin).count() << " sec" << std::endl;
 	if (usemask) classification->SetMask(mask);
+	classification->SetDenseStorage(dense);
+	if (sparse >= 0) classification->SetSparseStorage(sparse);
+	classification->SetLikelihoodCache(cachelikelihoods);
+	classification->SetLikelihoodTable(likelihoodtable);
+	classification->SetFusedIteration(fused);
+	classification->SetAcceleration(accelerate);
 	classification->SetPadding(padding);
 	classification->SetInput(image);
 	classification->Initialise();
@@ -152,6 +214,7 @@ int main(int argc, char **argv)
 		rel_diff = classification->Iterate(i);
 		i++;
 	} while ((rel_diff>0.001)&&(i<iterations));
+	classification->ResetAcceleration();
 
 	GenericImage<int> segmentation;
 	classification->ConstructSegmentation(segmentation);
@@ -162,6 +225,12 @@ int main(int argc, char **argv)
 		std::cout<<"saving probability map of structure "<<savesegsnr[i]<<" to "<<savesegs[i]<<std::endl;
 		classification->WriteProbMap(savesegsnr[i],savesegs[i].c_str());
 	}
+	if (probsfile) {
+		Array<int> labels;
+		for (int i = 0; i < n; ++i) labels.push_back((atlas_file.GetNumberOfMaps() > 0) ? atlas_file.GetLabel(i) : i);
+		std::cout<<"saving probability maps of structures to "<<probsfile<<std::endl;
+		classification->WriteProbMaps(probsfile, labels);
+	}
 
 	delete classification;
 
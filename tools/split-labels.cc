@@ -23,6 +23,7 @@
 #include "mirtk/IOConfig.h"
 #include "mirtk/GenericImage.h"
 #include "mirtk/HashProbabilisticAtlas.h"
+#include "mirtk/ProbabilityMapsFile.h"
 #include <string>
 
 using namespace mirtk;
@@ -43,6 +44,7 @@ void PrintHelp(const char *name)
 	std::cout << "  Measures the probability of the different labels in the N label maps <labelmap_1> .. <labelmap_N> " <<std::endl;
 	std::cout << "  according to the weights (maps) <weight_1> .. <weight_N> (based on occurence)." << std::endl;
 	std::cout << "  It then outputs the probability of the specified R labels <label_1> .. <label_R> to <probmap_1> .. <probmap_R>  "<<std::endl;
+	std::cout << "  or, if a single output with extension .pmaps is given instead, to one probability maps file of all R labels."<<std::endl;
 	std::cout << std::endl;
 	PrintStandardOptions(std::cout);
 	std::cout << std::endl;
@@ -80,8 +82,9 @@ int main(int argc, char **argv){
 	for(int j = 0; j < numStructuresToDo; j++){
 		values[j] = atoi(POSARG(a)); a++;
 	}
+	bool single = ProbabilityMapsFile::IsProbabilityMapsFile(POSARG(a));
 	for(int j = 0; j < numStructuresToDo; j++){
-		names[j] = POSARG(a); a++;
+		names[j] = POSARG(a); if(!single) a++;
 	}
 
 	// output
@@ -137,8 +140,12 @@ int main(int argc, char **argv){
 	}
 
 	// write output
-	for(int j = 0; j < numStructuresToDo; j++){
-		probs.Write(j, names[j].c_str());
+	if(single){
+		probs.WriteProbabilityMaps(names[0].c_str(), values);
+	}else{
+		for(int j = 0; j < numStructuresToDo; j++){
+			probs.Write(j, names[j].c_str());
+		}
 	}
 
         delete[] names;